@@ -3,143 +3,282 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <alsa/asoundlib.h>
 
 #include "rf-ctrl.h"
+#include "audio.h"
 
 #define HARDWARE_NAME			"Alsa"
 
-#define SAMPLE_SIZE			2 // 16bits (SND_PCM_FORMAT_S16_LE)
-#define SAMPLES_PER_FRAME		channels
-#define BYTES_PER_FRAME			(SAMPLE_SIZE * SAMPLES_PER_FRAME)
-
+#define ALSA_DEVICE_NAME_MAX		32
 #define ALSA_DEVICE_OUT			"default"
 
+#define ALSA_DEFAULT_RATE		48000
+#define ALSA_DEFAULT_CHANNELS		2
+#define ALSA_CHANNELS_MAX		8
+#define ALSA_SAMPLE_BYTES_MAX		4
+
+#define ALSA_PERIOD_SIZE		1024 // frames
+#define ALSA_PERIODS			4
+#define ALSA_WAIT_TIMEOUT		1000 // ms
+#define ALSA_XRUN_RETRY_MAX		3
+
+#define ALSA_QUEUE_LEN			4
+#define ALSA_JOB_DATA_MAX		((UINT16_MAX + 7)/8)
+#define ALSA_POLL_FDS_MAX		8
+
+#define ALSA_DATA_CHANNEL		1
+#define ALSA_TRANSMITTERS_MAX		2
+#define ALSA_PATTERNS_MAX		9 // 3 levels per transmitter
+
+/* Errors are only reported at -vv while looking for a usable device */
+#define alsa_error(...)			do { if (probing) dbg_printf(2, __VA_ARGS__); else fprintf(stderr, __VA_ARGS__); } while (0)
+
+typedef enum {
+	ALSA_LEVEL_HIGH =		0,
+	ALSA_LEVEL_LOW =		1,
+	ALSA_LEVEL_SILENCE =		2,
+} alsa_level_t;
+
+/* RF frame queued for the continuous stream */
+struct alsa_job {
+	struct timing_config config;
+	uint8_t data[ALSA_JOB_DATA_MAX];
+	uint16_t bit_count;
+	size_t end_pos; /* frames, absolute position of the end of the frame in the stream */
+};
+
+/* Formats tried in order when none is configured, the cheapest to render first */
+static const snd_pcm_format_t native_formats[] = {
+	SND_PCM_FORMAT_S16_LE,
+	SND_PCM_FORMAT_S16_BE,
+	SND_PCM_FORMAT_S32_LE,
+	SND_PCM_FORMAT_S32_BE,
+	SND_PCM_FORMAT_S24_LE,
+	SND_PCM_FORMAT_S8,
+	SND_PCM_FORMAT_U8,
+	SND_PCM_FORMAT_U16_LE,
+};
+
 static snd_pcm_t *playback_handle = NULL;
-static unsigned int samplerate = 48000;
-static unsigned int channels = 2;
-static unsigned int periods = 2;
-static snd_pcm_format_t sample_format = SND_PCM_FORMAT_S16_LE;
+static unsigned int samplerate = ALSA_DEFAULT_RATE;
+static unsigned int channels = ALSA_DEFAULT_CHANNELS;
+static unsigned int periods = ALSA_PERIODS;
+static snd_pcm_uframes_t period_size = ALSA_PERIOD_SIZE;
+static snd_pcm_uframes_t buffer_size = ALSA_PERIOD_SIZE * ALSA_PERIODS;
+static snd_pcm_format_t sample_format = SND_PCM_FORMAT_UNKNOWN;
 
+/* What has been asked for in the configuration */
+static unsigned int requested_rate = ALSA_DEFAULT_RATE;
+static unsigned int requested_channels = ALSA_DEFAULT_CHANNELS;
+static snd_pcm_format_t requested_format = SND_PCM_FORMAT_UNKNOWN;
+static int probing = 0;
 
-static int alsa_configure_device(snd_pcm_t *handle, size_t sample_count)
+/* Refined once the device parameters are known */
+static struct rf_hardware_caps alsa_caps = {
+	.time_step = (1000000 + ALSA_DEFAULT_RATE/2)/ALSA_DEFAULT_RATE,
+	.segmented_frames = 1,
+};
+
+/*
+ * One interleaved frame for each combination of the transmitter levels, in the negotiated format.
+ * The pattern index is the sum of level * 3^n over the transmitters.
+ */
+static size_t frame_bytes;
+static uint8_t frame_patterns[ALSA_PATTERNS_MAX][ALSA_CHANNELS_MAX * ALSA_SAMPLE_BYTES_MAX];
+
+/*
+ * Continuous mode: the PCM is kept running on silence by a feeder thread,
+ * and the queued frames are spliced into the stream as soon as possible.
+ * Each transmitter sends on its own channel, from its own queue, where
+ * jobs are queued at tail, rendered at render and completed at head.
+ */
+struct alsa_transmitter {
+	unsigned int channel;
+	struct alsa_job queue[ALSA_QUEUE_LEN];
+	unsigned int queue_head;
+	unsigned int queue_render;
+	unsigned int queue_tail;
+	/* Only used by the feeder thread */
+	struct alsa_job *job;
+	struct audio_render_state state;
+	size_t pending; /* frames left at the current level */
+	alsa_level_t level;
+};
+
+static uint8_t continuous = 0;
+static pthread_t feeder_thread;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct alsa_transmitter transmitters[ALSA_TRANSMITTERS_MAX];
+static unsigned int transmitter_count = 1;
+static unsigned int last_transmitter = 0;
+static int feeder_stop = 0;
+static int feeder_error = 0;
+static int wake_fds[2] = {-1, -1};
+
+
+static int alsa_configure_device(snd_pcm_t *handle)
 {
 	int err;
-	snd_pcm_hw_params_t *hw_params;
-	snd_pcm_sw_params_t *sw_params;
-	snd_pcm_uframes_t period_size; /* Periodsize (frames) */
-	snd_pcm_uframes_t buffer_size; /* Buffersize (frames) */
+	int ret = -1;
+	unsigned int i;
+	snd_pcm_hw_params_t *hw_params = NULL;
+	snd_pcm_sw_params_t *sw_params = NULL;
 
 	if (handle == NULL) {
-		fprintf(stderr, "%s: Alsa device not open\n", HARDWARE_NAME);
+		alsa_error("%s: Alsa device not open\n", HARDWARE_NAME);
 		return -1;
 	}
 
 	/* HW Params */
 	if ((err = snd_pcm_hw_params_malloc(&hw_params)) < 0) {
-		fprintf(stderr, "%s: cannot allocate hardware parameter structure (%s)\n", HARDWARE_NAME,
+		alsa_error("%s: cannot allocate hardware parameter structure (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 
 	if ((err = snd_pcm_hw_params_any(handle, hw_params)) < 0) {
-		fprintf (stderr, "%s: cannot initialize hardware parameter structure (%s)\n", HARDWARE_NAME,
+		alsa_error("%s: cannot initialize hardware parameter structure (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 
-	if ((err = snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-		fprintf(stderr, "%s: cannot set access type (%s)\n", HARDWARE_NAME,
+	if ((err = snd_pcm_hw_params_set_access(handle, hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0) {
+		alsa_error("%s: cannot set access type (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
+	}
+
+	/* Take the first native format the device supports, so that nothing converts the samples */
+	sample_format = requested_format;
+	for (i = 0; sample_format == SND_PCM_FORMAT_UNKNOWN && i < (sizeof(native_formats)/sizeof(native_formats[0])); i++) {
+		if (snd_pcm_hw_params_test_format(handle, hw_params, native_formats[i]) == 0) {
+			sample_format = native_formats[i];
+		}
+	}
+
+	if (sample_format == SND_PCM_FORMAT_UNKNOWN) {
+		alsa_error("%s: no supported sample format\n", HARDWARE_NAME);
+		goto out;
 	}
 
 	if ((err = snd_pcm_hw_params_set_format(handle, hw_params, sample_format)) < 0) {
-		fprintf(stderr, "%s: cannot set sample format (%s)\n", HARDWARE_NAME,
+		alsa_error("%s: cannot set sample format %s (%s)\n", HARDWARE_NAME,
+			 snd_pcm_format_name(sample_format), snd_strerror (err));
+		goto out;
+	}
+	dbg_printf(2, "%s: Sample format: %s\n", HARDWARE_NAME, snd_pcm_format_name(sample_format));
+
+	/* The edges are placed at any rate, so better take the native one than resample */
+	if ((err = snd_pcm_hw_params_set_rate_resample(handle, hw_params, 0)) < 0) {
+		alsa_error("%s: cannot disable resampling (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 
+	samplerate = requested_rate;
 	if ((err = snd_pcm_hw_params_set_rate_near(handle, hw_params, &samplerate, 0)) < 0) {
-		fprintf(stderr, "%s: cannot set sample rate (%s)\n", HARDWARE_NAME,
+		alsa_error("%s: cannot set sample rate (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 	dbg_printf(2, "%s: Samplerate: %u\n", HARDWARE_NAME, samplerate);
 
-	if ((err = snd_pcm_hw_params_set_channels(handle, hw_params, channels)) < 0) {
-		fprintf(stderr, "%s: cannot set channel count (%s)\n", HARDWARE_NAME,
+	channels = requested_channels;
+	if ((err = snd_pcm_hw_params_set_channels_near(handle, hw_params, &channels)) < 0) {
+		alsa_error("%s: cannot set channel count (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 	dbg_printf(2, "%s: Channels: %u\n", HARDWARE_NAME, channels);
 
+	if (channels > ALSA_CHANNELS_MAX) {
+		alsa_error("%s: too many channels (%u)\n", HARDWARE_NAME, channels);
+		goto out;
+	}
+
 	if ((err = snd_pcm_hw_params_set_periods_near(handle, hw_params, &periods, 0)) < 0) {
-		fprintf(stderr, "%s: cannot set period count (%s)\n", HARDWARE_NAME,
+		alsa_error("%s: cannot set period count (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 	dbg_printf(3, "%s: Periods : %u\n", HARDWARE_NAME, periods);
 
-	period_size = (sample_count/SAMPLES_PER_FRAME);
 	if ((err = snd_pcm_hw_params_set_period_size_near(handle, hw_params, &period_size, 0)) < 0) {
-		fprintf(stderr, "%s: cannot set period size (%s)\n", HARDWARE_NAME,
+		alsa_error("%s: cannot set period size (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
-	dbg_printf(3, "%s: Period size : %u\n", HARDWARE_NAME, period_size);
+	dbg_printf(3, "%s: Period size : %lu\n", HARDWARE_NAME, (long unsigned int) period_size);
 
 	buffer_size = period_size * periods;
 	if ((err = snd_pcm_hw_params_set_buffer_size_near(handle, hw_params, &buffer_size)) < 0) {
-		fprintf(stderr, "%s: cannot set buffer size (%s)\n", HARDWARE_NAME,
+		alsa_error("%s: cannot set buffer size (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 	dbg_printf(3, "%s: Buffer size: %lu\n", HARDWARE_NAME, (long unsigned int) buffer_size);
 
 	if ((err = snd_pcm_hw_params(handle, hw_params)) < 0) {
-		fprintf(stderr, "%s: cannot set parameters (%s)\n", HARDWARE_NAME,
+		alsa_error("%s: cannot set parameters (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 
 	/* SW Params */
 	if ((err = snd_pcm_sw_params_malloc(&sw_params)) < 0) {
-		fprintf(stderr, "%s: cannot allocate software parameter structure (%s)\n", HARDWARE_NAME,
+		alsa_error("%s: cannot allocate software parameter structure (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 
-	if (snd_pcm_sw_params_current(handle, sw_params) < 0) {
-		fprintf(stderr, "%s: cannot get sw params (%s)\n", HARDWARE_NAME,
+	if ((err = snd_pcm_sw_params_current(handle, sw_params)) < 0) {
+		alsa_error("%s: cannot get sw params (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 
-	/* Start playing after the first write */
-	if (snd_pcm_sw_params_set_start_threshold(handle, sw_params, 1) < 0) {
-		fprintf(stderr, "%s: cannot set start threshold (%s)\n", HARDWARE_NAME,
+	/*
+	 * Start playing once the ring buffer is full (shorter frames are started by the drain),
+	 * the continuous stream is started explicitly
+	 */
+	if ((err = snd_pcm_sw_params_set_start_threshold(handle, sw_params, continuous ? buffer_size * 2 : buffer_size)) < 0) {
+		alsa_error("%s: cannot set start threshold (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 
-	/* Wake up on every interrupt */
-	if (snd_pcm_sw_params_set_avail_min(handle, sw_params, 1) < 0) {
-		fprintf(stderr, "%s: cannot set min avail (%s)\n", HARDWARE_NAME,
+	/* Wake up when a whole period can be written */
+	if ((err = snd_pcm_sw_params_set_avail_min(handle, sw_params, period_size)) < 0) {
+		alsa_error("%s: cannot set min avail (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 
-	if (snd_pcm_sw_params(handle, sw_params) < 0) {
-		fprintf(stderr, "%s: cannot set sw params (%s)\n", HARDWARE_NAME,
+	if ((err = snd_pcm_sw_params(handle, sw_params)) < 0) {
+		alsa_error("%s: cannot set sw params (%s)\n", HARDWARE_NAME,
 			 snd_strerror (err));
-		return -1;
+		goto out;
 	}
 
-	snd_pcm_hw_params_free(hw_params);
-	snd_pcm_sw_params_free(sw_params);
+	ret = 0;
 
-	return 0;
+out:
+	if (hw_params != NULL) {
+		snd_pcm_hw_params_free(hw_params);
+	}
+
+	if (sw_params != NULL) {
+		snd_pcm_sw_params_free(sw_params);
+	}
+
+	return ret;
 }
 
 static int alsa_open_playback(char * device_out)
@@ -148,7 +287,7 @@ static int alsa_open_playback(char * device_out)
 
 	if (playback_handle == NULL) {
 		if ((err = snd_pcm_open(&playback_handle, device_out, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-			fprintf(stderr, "%s: cannot open audio device %s (playback) (%s)\n", HARDWARE_NAME,
+			alsa_error("%s: cannot open audio device %s (playback) (%s)\n", HARDWARE_NAME,
 				device_out,
 				snd_strerror (err));
 			return -1;
@@ -170,19 +309,179 @@ static void alsa_close_playback(void)
 	return;
 }
 
-static int alsa_write_audio(uint16_t *buf, size_t sample_count) {
-	int ret = 0;
-	int err;
+static void alsa_render_init(struct audio_render_state *state, struct timing_config *config, uint8_t *frame_data, uint16_t bit_count)
+{
+	audio_render_init(state, config, frame_data, bit_count, samplerate);
 
-	dbg_printf(2, "%s: Number of samples to write: %u\n", HARDWARE_NAME, sample_count);
+	dbg_printf(3, "%s: Frame length: %lu samples\n", HARDWARE_NAME, (long unsigned int) state->total);
+}
 
-	if (playback_handle == NULL) {
-		fprintf(stderr, "%s: Alsa device not open\n", HARDWARE_NAME);
+/* Build one sample of the given level in the negotiated format (differential signal, so high is the lowest value) */
+static void alsa_build_sample(uint8_t *dest, alsa_level_t level)
+{
+	int width = snd_pcm_format_width(sample_format);
+	int bytes = snd_pcm_format_physical_width(sample_format) / 8;
+	int64_t value;
+	int i;
+
+	switch (level) {
+	case ALSA_LEVEL_HIGH:
+		value = -(1LL << (width - 1));
+		break;
+	case ALSA_LEVEL_LOW:
+		value = (1LL << (width - 1)) - 1;
+		break;
+	default:
+		value = 0;
+		break;
+	}
+
+	if (!snd_pcm_format_signed(sample_format)) {
+		value += 1LL << (width - 1);
+	}
+
+	for (i = 0; i < bytes; i++) {
+		dest[snd_pcm_format_little_endian(sample_format) ? i : (bytes - 1 - i)] = (value >> (8 * i)) & 0xFF;
+	}
+}
+
+static int alsa_build_frame_patterns(void)
+{
+	int bytes = snd_pcm_format_physical_width(sample_format) / 8;
+	unsigned int pattern, pattern_count = 1;
+	unsigned int i, j, weight;
+	alsa_level_t level;
+
+	if (!snd_pcm_format_linear(sample_format) || bytes <= 0 || bytes > ALSA_SAMPLE_BYTES_MAX) {
+		alsa_error("%s: unsupported sample format %s\n", HARDWARE_NAME, snd_pcm_format_name(sample_format));
+		return -1;
+	}
+
+	if (channels < transmitter_count) {
+		alsa_error("%s: not enough channels for %u transmitters\n", HARDWARE_NAME, transmitter_count);
 		return -1;
 	}
 
-	if (alsa_configure_device(playback_handle, sample_count) < 0) {
-		fprintf(stderr, "%s: device configuration failed\n", HARDWARE_NAME);
+	if (transmitter_count == 1) {
+		/* The signal goes on the second channel (or the only one), the other ones stay silent */
+		transmitters[0].channel = (channels > ALSA_DATA_CHANNEL) ? ALSA_DATA_CHANNEL : (channels - 1);
+	} else {
+		for (i = 0; i < transmitter_count; i++) {
+			transmitters[i].channel = i;
+		}
+	}
+
+	frame_bytes = channels * bytes;
+
+	for (i = 0; i < transmitter_count; i++) {
+		pattern_count *= 3;
+	}
+
+	for (pattern = 0; pattern < pattern_count; pattern++) {
+		for (j = 0; j < channels; j++) {
+			level = ALSA_LEVEL_SILENCE;
+			for (i = 0, weight = 1; i < transmitter_count; i++, weight *= 3) {
+				if (transmitters[i].channel == j) {
+					level = (pattern / weight) % 3;
+				}
+			}
+
+			alsa_build_sample(&frame_patterns[pattern][j * bytes], level);
+		}
+	}
+
+	return 0;
+}
+
+static uint8_t * alsa_area_ptr(const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset)
+{
+	return (uint8_t *) areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+}
+
+/*
+ * Render the next frames of the RF frame into an interleaved area, and return the number of frames rendered,
+ * which is lower than requested once the end of the RF frame is reached
+ */
+static snd_pcm_uframes_t alsa_render_frames(struct audio_render_state *state, const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames)
+{
+	uint8_t *dest = alsa_area_ptr(areas, offset);
+	snd_pcm_uframes_t count = 0;
+	size_t run, i;
+	uint8_t level;
+	uint8_t *pattern;
+
+	while (count < frames && (run = audio_render_run(state, frames - count, &level)) > 0) {
+		pattern = frame_patterns[level ? ALSA_LEVEL_HIGH : ALSA_LEVEL_LOW];
+
+		for (i = 0; i < run; i++) {
+			memcpy(dest, pattern, frame_bytes);
+			dest += frame_bytes;
+		}
+
+		count += run;
+	}
+
+	return count;
+}
+
+/* Render and write the next chunk of the RF frame, as much as the ring buffer can take */
+static int alsa_write_chunk(struct audio_render_state *state, size_t *pos)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail, committed;
+	int err;
+
+	avail = snd_pcm_avail_update(playback_handle);
+	if (avail < 0) {
+		return avail;
+	}
+
+	if (avail == 0 || ((snd_pcm_uframes_t) avail < period_size && (size_t) avail < (state->total - *pos))) {
+		/* Wait for the hardware to consume a period */
+		if (snd_pcm_state(playback_handle) == SND_PCM_STATE_PREPARED) {
+			snd_pcm_start(playback_handle);
+		}
+
+		if ((err = snd_pcm_wait(playback_handle, ALSA_WAIT_TIMEOUT)) < 0) {
+			return err;
+		}
+		return 0;
+	}
+
+	frames = state->total - *pos;
+	if (frames > (snd_pcm_uframes_t) avail) {
+		frames = avail;
+	}
+
+	if ((err = snd_pcm_mmap_begin(playback_handle, &areas, &offset, &frames)) < 0) {
+		return err;
+	}
+
+	frames = alsa_render_frames(state, areas, offset, frames);
+	*pos += frames;
+
+	committed = snd_pcm_mmap_commit(playback_handle, offset, frames);
+	if (committed < 0 || (snd_pcm_uframes_t) committed != frames) {
+		return (committed < 0) ? committed : -EPIPE;
+	}
+
+	return 0;
+}
+
+/*
+ * Stream the RF frame to the device, rendering it period by period just ahead of the hardware pointer,
+ * so that the memory used does not depend on the length of the transmission
+ */
+static int alsa_write_audio(struct audio_render_state *state) {
+	unsigned int xruns = 0;
+	size_t pos = 0;
+	int err;
+
+	dbg_printf(2, "%s: Number of samples to write: %lu\n", HARDWARE_NAME, (long unsigned int) (state->total * channels));
+
+	if (playback_handle == NULL) {
+		fprintf(stderr, "%s: Alsa device not open\n", HARDWARE_NAME);
 		return -1;
 	}
 
@@ -192,54 +491,431 @@ static int alsa_write_audio(uint16_t *buf, size_t sample_count) {
 		return -1;
 	}
 
-	if ((err = snd_pcm_writei(playback_handle, buf, sample_count/SAMPLES_PER_FRAME)) != sample_count/SAMPLES_PER_FRAME) {
-		fprintf(stderr, "%s: Write error (%s)\n", HARDWARE_NAME, snd_strerror (err));
+	while (pos < state->total) {
+		if ((err = alsa_write_chunk(state, &pos)) == 0) {
+			continue;
+		}
+
+		if ((err != -EPIPE && err != -ESTRPIPE) || ++xruns > ALSA_XRUN_RETRY_MAX) {
+			fprintf(stderr, "%s: Write error (%s)\n", HARDWARE_NAME, snd_strerror (err));
+			return -1;
+		}
+
+		/* The RF frame has been cut by an underrun (or a suspend), send it again from the start */
+		dbg_printf(1, "%s: Underrun, restarting the transmission\n", HARDWARE_NAME);
+
+		if ((err = snd_pcm_recover(playback_handle, err, 1)) < 0) {
+			fprintf(stderr, "%s: cannot recover from underrun (%s)\n", HARDWARE_NAME, snd_strerror (err));
+			return -1;
+		}
+
+		alsa_render_init(state, state->config, state->frame_data, state->bit_count);
+		pos = 0;
 	}
 
 	snd_pcm_drain(playback_handle);
 
-	return ret;
+	return 0;
+}
+
+/* Start rendering the next queued job of a transmitter, if any. Called with queue_mutex held. */
+static void alsa_next_job(struct alsa_transmitter *tx)
+{
+	tx->job = NULL;
+	tx->pending = 0;
+
+	if (tx->queue_render == tx->queue_tail) {
+		return;
+	}
+
+	tx->job = &tx->queue[tx->queue_render % ALSA_QUEUE_LEN];
+	alsa_render_init(&tx->state, &tx->job->config, tx->job->data, tx->job->bit_count);
+}
+
+/* Get the next run of frames of a transmitter (at most max), chaining its frames without any gap */
+static void alsa_next_run(struct alsa_transmitter *tx, size_t max, size_t pos, size_t *data_end)
+{
+	uint8_t level;
+
+	while (tx->job != NULL) {
+		tx->pending = audio_render_run(&tx->state, max, &level);
+		if (tx->pending > 0) {
+			tx->level = level ? ALSA_LEVEL_HIGH : ALSA_LEVEL_LOW;
+			return;
+		}
+
+		/* Frame fully rendered */
+		if (pos > *data_end) {
+			*data_end = pos;
+		}
+
+		pthread_mutex_lock(&queue_mutex);
+		tx->job->end_pos = pos;
+		tx->queue_render++;
+		alsa_next_job(tx);
+		pthread_mutex_unlock(&queue_mutex);
+	}
+
+	/* Idle until the end of the period */
+	tx->pending = max;
+	tx->level = ALSA_LEVEL_SILENCE;
 }
 
-static uint16_t * alsa_convert_frame_to_audio(size_t *sample_count, struct timing_config *config, uint8_t *src_frame, size_t src_bit_count)
+/* Render a period, merging the runs of all the transmitters */
+static void alsa_render_period(uint8_t *dest, snd_pcm_uframes_t frames, size_t written, size_t *data_end)
 {
-	int ret, i, j, k;
-	uint16_t *dest_frame;
-	size_t count;
-	uint32_t samples_per_bit = round((config->base_time * samplerate)/1000000.0f);
-	size_t samples_per_rf_frame = src_bit_count * samples_per_bit * channels;
+	struct alsa_transmitter *tx;
+	snd_pcm_uframes_t count = 0;
+	size_t run, i;
+	unsigned int pattern, weight, n;
 
-	dbg_printf(2, "%s: Samples per bit: %u\n", HARDWARE_NAME, samples_per_bit);
+	while (count < frames) {
+		run = frames - count;
+		pattern = 0;
 
-	*sample_count = samples_per_rf_frame * config->frame_count;
-	if (*sample_count < 16000) {
-		/* Be sure the final buffer will be big enough to prevent underruns */
-		*sample_count = 16000;
+		for (n = 0, weight = 1; n < transmitter_count; n++, weight *= 3) {
+			tx = &transmitters[n];
+			if (tx->pending == 0) {
+				alsa_next_run(tx, frames - count, written + count, data_end);
+			}
+
+			if (tx->pending < run) {
+				run = tx->pending;
+			}
+			pattern += tx->level * weight;
+		}
+
+		for (i = 0; i < run; i++) {
+			memcpy(dest, frame_patterns[pattern], frame_bytes);
+			dest += frame_bytes;
+		}
+
+		for (n = 0; n < transmitter_count; n++) {
+			transmitters[n].pending -= run;
+		}
+
+		count += run;
 	}
+}
 
-	dest_frame = (uint16_t *) malloc(sizeof(uint16_t) * (*sample_count));
-	if(!dest_frame) {
-		fprintf(stderr, "%s: cannot allocate memory for audio buffer\n", HARDWARE_NAME);
-		return NULL;
+/* Pick up the frames queued for idle transmitters, and splice them as soon as possible */
+static void alsa_start_jobs(size_t *written, size_t data_end)
+{
+	struct alsa_transmitter *tx;
+	snd_pcm_sframes_t rewind;
+	int busy = 0, started = 0;
+	unsigned int n;
+
+	pthread_mutex_lock(&queue_mutex);
+	for (n = 0; n < transmitter_count; n++) {
+		tx = &transmitters[n];
+		if (tx->job != NULL) {
+			busy = 1;
+		} else {
+			alsa_next_job(tx);
+			started |= (tx->job != NULL);
+		}
 	}
+	pthread_mutex_unlock(&queue_mutex);
 
-	memset(dest_frame, 0, sizeof(uint16_t) * (*sample_count));
+	/*
+	 * Overwrite the silence already queued, right after the next period,
+	 * unless another transmitter is sending (its frame would have to be rendered again)
+	 */
+	if (!started || busy) {
+		return;
+	}
 
-	for (k = 0; k < config->frame_count; k++) {
-		for (i = 0; i < src_bit_count; i++) {
-			if (src_frame[i/8] & (1 << (7 - (i % 8)))) {
-				for (j = 0; j < samples_per_bit; j++) {
-					dest_frame[k * samples_per_rf_frame + 2 * (i * samples_per_bit + j) + 1] = 0x8000;
-				}
-			} else {
-				for (j = 0; j < samples_per_bit; j++) {
-					dest_frame[k * samples_per_rf_frame + 2 * (i * samples_per_bit + j) + 1] = 0x7FFF;
+	rewind = snd_pcm_rewindable(playback_handle) - period_size;
+	if (rewind > (snd_pcm_sframes_t) (*written - data_end)) {
+		rewind = *written - data_end;
+	}
+
+	if (rewind > 0) {
+		rewind = snd_pcm_rewind(playback_handle, rewind);
+		if (rewind > 0) {
+			*written -= rewind;
+		}
+	}
+}
+
+/* Fill the ring buffer with the queued frames, or with silence */
+static int alsa_feed(size_t *written, size_t *data_end)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail;
+	int err;
+
+	for (;;) {
+		alsa_start_jobs(written, *data_end);
+
+		avail = snd_pcm_avail_update(playback_handle);
+		if (avail < 0) {
+			return avail;
+		}
+
+		if ((snd_pcm_uframes_t) avail < period_size) {
+			return 0;
+		}
+
+		frames = period_size;
+		if ((err = snd_pcm_mmap_begin(playback_handle, &areas, &offset, &frames)) < 0) {
+			return err;
+		}
+
+		alsa_render_period(alsa_area_ptr(areas, offset), frames, *written, data_end);
+
+		avail = snd_pcm_mmap_commit(playback_handle, offset, frames);
+		if (avail < 0) {
+			return avail;
+		}
+
+		*written += frames;
+	}
+}
+
+/* Complete the jobs that have been played, according to the hardware position */
+static void alsa_complete_jobs(size_t written)
+{
+	struct alsa_transmitter *tx;
+	snd_pcm_sframes_t delay;
+	size_t played;
+	unsigned int n;
+
+	if (snd_pcm_delay(playback_handle, &delay) < 0) {
+		return;
+	}
+
+	played = written - delay;
+
+	pthread_mutex_lock(&queue_mutex);
+	for (n = 0; n < transmitter_count; n++) {
+		tx = &transmitters[n];
+		while (tx->queue_head != tx->queue_render && tx->queue[tx->queue_head % ALSA_QUEUE_LEN].end_pos <= played) {
+			dbg_printf(2, "%s: Frame played on channel %u\n", HARDWARE_NAME, tx->channel);
+			tx->queue_head++;
+			pthread_cond_broadcast(&queue_cond);
+		}
+	}
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+/* Whether all the queued frames have been played. Called with queue_mutex held. */
+static int alsa_queues_empty(void)
+{
+	unsigned int n;
+
+	for (n = 0; n < transmitter_count; n++) {
+		if (transmitters[n].queue_head != transmitters[n].queue_tail) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void *alsa_feeder(void *param)
+{
+	struct pollfd fds[ALSA_POLL_FDS_MAX + 1];
+	struct alsa_transmitter *tx;
+	size_t written = 0, data_end = 0;
+	unsigned short revents;
+	unsigned int n;
+	int pcm_fd_count;
+	char c;
+	int err = 0;
+
+	(void) param;
+
+	pcm_fd_count = snd_pcm_poll_descriptors(playback_handle, fds + 1, ALSA_POLL_FDS_MAX);
+
+	fds[0].fd = wake_fds[0];
+	fds[0].events = POLLIN;
+
+	/* Fill the ring buffer with silence and start the stream */
+	if ((err = alsa_feed(&written, &data_end)) >= 0) {
+		err = snd_pcm_start(playback_handle);
+	}
+
+	while (err >= 0) {
+		pthread_mutex_lock(&queue_mutex);
+		if (feeder_stop && alsa_queues_empty()) {
+			pthread_mutex_unlock(&queue_mutex);
+			break;
+		}
+		pthread_mutex_unlock(&queue_mutex);
+
+		if (poll(fds, pcm_fd_count + 1, ALSA_WAIT_TIMEOUT) < 0) {
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			/* Just empty the pipe, the queue is checked below */
+			while (read(wake_fds[0], &c, 1) == 1);
+		}
+
+		if ((err = snd_pcm_poll_descriptors_revents(playback_handle, fds + 1, pcm_fd_count, &revents)) < 0) {
+			break;
+		}
+
+		if (revents & POLLERR) {
+			/* Underrun, restart the stream */
+			dbg_printf(1, "%s: Underrun in continuous stream\n", HARDWARE_NAME);
+			if ((err = snd_pcm_recover(playback_handle, -EPIPE, 1)) < 0) {
+				break;
+			}
+
+			/* The frames already rendered are lost, and the current one is restarted */
+			pthread_mutex_lock(&queue_mutex);
+			for (n = 0; n < transmitter_count; n++) {
+				tx = &transmitters[n];
+				tx->queue_head = tx->queue_render;
+
+				if (tx->job != NULL) {
+					alsa_render_init(&tx->state, &tx->job->config, tx->job->data, tx->job->bit_count);
+					tx->pending = 0;
 				}
 			}
+			pthread_cond_broadcast(&queue_cond);
+			pthread_mutex_unlock(&queue_mutex);
+
+			written = data_end = 0;
+			if ((err = alsa_feed(&written, &data_end)) >= 0) {
+				err = snd_pcm_start(playback_handle);
+			}
+			continue;
+		}
+
+		err = alsa_feed(&written, &data_end);
+
+		alsa_complete_jobs(written);
+	}
+
+	if (err < 0) {
+		fprintf(stderr, "%s: Continuous stream error (%s)\n", HARDWARE_NAME, snd_strerror (err));
+	}
+
+	pthread_mutex_lock(&queue_mutex);
+	feeder_error = (err < 0) ? err : 0;
+	feeder_stop = 1;
+	pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_mutex);
+
+	return NULL;
+}
+
+static void alsa_wake_feeder(void)
+{
+	char c = 0;
+
+	if (write(wake_fds[1], &c, 1) < 0) {
+		/* The pipe is full, the feeder will wake up anyway */
+	}
+}
+
+static int alsa_start_feeder(void)
+{
+	unsigned int n;
+
+	if (pipe(wake_fds) < 0) {
+		fprintf(stderr, "%s: cannot create the feeder pipe (%s)\n", HARDWARE_NAME, strerror(errno));
+		return -1;
+	}
+
+	fcntl(wake_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake_fds[1], F_SETFL, O_NONBLOCK);
+
+	for (n = 0; n < transmitter_count; n++) {
+		transmitters[n].queue_head = transmitters[n].queue_render = transmitters[n].queue_tail = 0;
+		transmitters[n].job = NULL;
+		transmitters[n].pending = 0;
+	}
+	last_transmitter = transmitter_count - 1;
+	feeder_stop = 0;
+	feeder_error = 0;
+
+	if (pthread_create(&feeder_thread, NULL, &alsa_feeder, NULL) != 0) {
+		fprintf(stderr, "%s: cannot start the feeder thread\n", HARDWARE_NAME);
+		close(wake_fds[0]);
+		close(wake_fds[1]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Wait for all the queued frames to be played, and stop the stream */
+static void alsa_stop_feeder(void)
+{
+	pthread_mutex_lock(&queue_mutex);
+	feeder_stop = 1;
+	pthread_mutex_unlock(&queue_mutex);
+
+	alsa_wake_feeder();
+
+	pthread_join(feeder_thread, NULL);
+
+	snd_pcm_drop(playback_handle);
+
+	close(wake_fds[0]);
+	close(wake_fds[1]);
+}
+
+/* Pick the least busy transmitter, in a round-robin way. Called with queue_mutex held. */
+static struct alsa_transmitter * alsa_pick_transmitter(void)
+{
+	struct alsa_transmitter *tx, *best = NULL;
+	unsigned int i, n;
+
+	for (i = 1; i <= transmitter_count; i++) {
+		n = (last_transmitter + i) % transmitter_count;
+		tx = &transmitters[n];
+
+		if ((tx->queue_tail - tx->queue_head) >= ALSA_QUEUE_LEN) {
+			continue;
 		}
+
+		if (best == NULL || (tx->queue_tail - tx->queue_head) < (best->queue_tail - best->queue_head)) {
+			best = tx;
+			last_transmitter = n;
+		}
+	}
+
+	return best;
+}
+
+static int alsa_queue_frame(struct timing_config *config, uint8_t *frame_data, uint16_t bit_count)
+{
+	struct alsa_transmitter *tx = NULL;
+	struct alsa_job *job;
+	int ret;
+
+	pthread_mutex_lock(&queue_mutex);
+
+	while (!feeder_stop && (tx = alsa_pick_transmitter()) == NULL) {
+		pthread_cond_wait(&queue_cond, &queue_mutex);
+	}
+
+	if (feeder_stop) {
+		ret = feeder_error ? feeder_error : -1;
+		pthread_mutex_unlock(&queue_mutex);
+		return ret;
 	}
 
-	return dest_frame;
+	dbg_printf(3, "%s: Frame queued on channel %u\n", HARDWARE_NAME, tx->channel);
+
+	job = &tx->queue[tx->queue_tail % ALSA_QUEUE_LEN];
+	job->config = *config;
+	memcpy(job->data, frame_data, (bit_count + 7)/8);
+	job->bit_count = bit_count;
+	tx->queue_tail++;
+
+	pthread_mutex_unlock(&queue_mutex);
+
+	alsa_wake_feeder();
+
+	return 0;
 }
 
 static int alsa_probe(void) {
@@ -247,32 +923,146 @@ static int alsa_probe(void) {
 	return -1;
 }
 
-static int alsa_init(struct rf_hardware_params *params) {
-	return alsa_open_playback(ALSA_DEVICE_OUT);
-}
-
 static void alsa_close(void) {
+	if (continuous && playback_handle != NULL) {
+		alsa_stop_feeder();
+	}
+
 	alsa_close_playback();
 }
 
-static int alsa_send_cmd(struct timing_config *config, uint8_t *frame_data, uint16_t bit_count) {
-	int ret = -1;
-	size_t sample_count = 0;
-	uint16_t *audio_data = alsa_convert_frame_to_audio(&sample_count, config, frame_data, bit_count);
+/* Open and configure the device, and keep it only if it accepts our parameters */
+/* Direct access device of the card behind the default device, if any (not for a sound server) */
+static int alsa_get_default_direct(char *device_out, size_t len)
+{
+	snd_pcm_t *handle;
+	snd_pcm_info_t *info;
+	int card, ret = -1;
 
-	if (audio_data != NULL) {
-		ret = alsa_write_audio(audio_data, sample_count);
-		free(audio_data);
+	if (snd_pcm_open(&handle, ALSA_DEVICE_OUT, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) < 0) {
+		return -1;
 	}
 
+	snd_pcm_info_alloca(&info);
+	if (snd_pcm_info(handle, info) == 0) {
+		card = snd_pcm_info_get_card(info);
+		if (card >= 0) {
+			snprintf(device_out, len, "hw:%d,%u", card, snd_pcm_info_get_device(info));
+			ret = 0;
+		}
+	}
+
+	snd_pcm_close(handle);
+
 	return ret;
 }
 
+static int alsa_try_device(char *device_out, int fallback)
+{
+	int ret = 0;
+
+	dbg_printf(3, "%s: Trying device %s\n", HARDWARE_NAME, device_out);
+
+	probing = fallback;
+
+	if (alsa_open_playback(device_out) < 0) {
+		ret = -1;
+	} else if (alsa_configure_device(playback_handle) < 0 || alsa_build_frame_patterns() < 0) {
+		/* The PCM is configured once for all the commands */
+		alsa_error("%s: device configuration failed (%s)\n", HARDWARE_NAME, device_out);
+		alsa_close_playback();
+		ret = -1;
+	}
+
+	probing = 0;
+
+	if (ret < 0) {
+		return -1;
+	}
+
+	dbg_printf(2, "%s: Using device %s (%s, %u Hz, %u channels)\n", HARDWARE_NAME, device_out,
+		snd_pcm_format_name(sample_format), samplerate, channels);
+
+	return 0;
+}
+
+static int alsa_init(struct rf_hardware_params *params) {
+	char direct_device[ALSA_DEVICE_NAME_MAX];
+
+	continuous = params->alsa_continuous;
+	transmitter_count = 1;
+
+	if (params->alsa_dual_channel) {
+		/* Both channels are scheduled independently, which needs the continuous stream */
+		transmitter_count = 2;
+		continuous = 1;
+	}
+
+	requested_rate = params->alsa_rate ? params->alsa_rate : ALSA_DEFAULT_RATE;
+	requested_channels = params->alsa_channels ? params->alsa_channels : ALSA_DEFAULT_CHANNELS;
+	if (requested_channels < transmitter_count) {
+		requested_channels = transmitter_count;
+	}
+	requested_format = SND_PCM_FORMAT_UNKNOWN;
+
+	if (params->alsa_format != NULL) {
+		requested_format = snd_pcm_format_value(params->alsa_format);
+		if (requested_format == SND_PCM_FORMAT_UNKNOWN) {
+			fprintf(stderr, "%s: unknown sample format %s\n", HARDWARE_NAME, params->alsa_format);
+			return -1;
+		}
+	}
+
+	if (params->provided_params & PARAM_HW_DEVICE) {
+		if (alsa_try_device(params->device, 0) < 0) {
+			return -1;
+		}
+	} else if (alsa_get_default_direct(direct_device, sizeof(direct_device)) < 0
+			|| alsa_try_device(direct_device, 1) < 0) {
+		/* Direct access is not possible (sound server, busy or unsupported parameters), go through the default device */
+		if (alsa_try_device(ALSA_DEVICE_OUT, 0) < 0) {
+			return -1;
+		}
+	}
+
+	/* Edges are placed at the nearest sample, and a frame is heard once the buffer ahead of it is played */
+	alsa_caps.time_step = (1000000 + samplerate/2)/samplerate;
+	alsa_caps.setup_time = (uint32_t) (((uint64_t) buffer_size * 1000000)/samplerate);
+
+	if (continuous) {
+		dbg_printf(1, "%s: Continuous stream mode, %u transmitter(s)\n", HARDWARE_NAME, transmitter_count);
+
+		if (alsa_start_feeder() < 0) {
+			alsa_close_playback();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int alsa_send_cmd(struct timing_config *config, uint8_t *frame_data, uint16_t bit_count) {
+	struct audio_render_state state;
+
+	if (continuous) {
+		return alsa_queue_frame(config, frame_data, bit_count);
+	}
+
+	alsa_render_init(&state, config, frame_data, bit_count);
+
+	if (state.total == 0) {
+		return 0;
+	}
+
+	return alsa_write_audio(&state);
+}
+
 struct rf_hardware_driver alsa_driver = {
 	.name = HARDWARE_NAME,
 	.cmd_name = "alsa",
 	.long_name = "Alsa 433MHz Differential RF Transceiver",
-	.supported_bit_fmts = (1 << RF_BIT_FMT_RAW),
+	.supported_bit_fmts = (1 << RF_BIT_FMT_HL) | (1 << RF_BIT_FMT_LH) | (1 << RF_BIT_FMT_RAW),
+	.caps = &alsa_caps,
 	.probe = &alsa_probe,
 	.init = &alsa_init,
 	.close = &alsa_close,
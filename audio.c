@@ -0,0 +1,159 @@
+/*
+ * rf-ctrl - A command-line tool to control 433MHz OOK based devices
+ * Helper functions for audio (PCM) frame rendering
+ *
+ * Copyright (C) 2018 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rf-ctrl.h"
+#include "audio.h"
+
+
+static uint64_t audio_time_to_samples(uint64_t time, unsigned int samplerate) {
+	/* Rounded to the nearest sample */
+	return (time * samplerate + 500000)/1000000;
+}
+
+static uint8_t audio_get_bit(uint8_t *data, uint32_t idx) {
+	return (data[idx/8] & (1 << (7 - (idx % 8)))) != 0;
+}
+
+/* Get the level and duration (us) of a pulse of the frame */
+static void audio_get_pulse(struct audio_render_state *state, uint32_t idx, uint8_t *level, uint16_t *duration) {
+	struct timing_config *config = state->config;
+	uint16_t h_time, l_time;
+
+	if (config->bit_fmt == RF_BIT_FMT_RAW) {
+		*level = audio_get_bit(state->frame_data, idx);
+		*duration = config->base_time;
+		return;
+	}
+
+	/* Start bit, data bits and end bit, two pulses each */
+	if (idx < 2) {
+		h_time = config->start_bit_h_time;
+		l_time = config->start_bit_l_time;
+	} else if (idx < (2 + 2 * (uint32_t) state->bit_count)) {
+		if (audio_get_bit(state->frame_data, (idx - 2)/2)) {
+			h_time = config->data_bit1_h_time;
+			l_time = config->data_bit1_l_time;
+		} else {
+			h_time = config->data_bit0_h_time;
+			l_time = config->data_bit0_l_time;
+		}
+	} else {
+		h_time = config->end_bit_h_time;
+		l_time = config->end_bit_l_time;
+	}
+
+	/* HL symbols start with the high level, LH symbols with the low one */
+	if ((idx % 2 == 0) == (config->bit_fmt == RF_BIT_FMT_HL)) {
+		*level = 1;
+		*duration = h_time;
+	} else {
+		*level = 0;
+		*duration = l_time;
+	}
+}
+
+/* The first repetition starts with the preamble, and the last one ends with the trailer */
+static uint32_t audio_frame_end(struct audio_render_state *state) {
+	return (state->frame_idx + 1 >= state->config->frame_count) ? state->pulse_count : state->body_end;
+}
+
+void audio_render_init(struct audio_render_state *state, struct timing_config *config, uint8_t *frame_data, uint16_t bit_count, unsigned int samplerate) {
+	uint64_t frame_time = 0, once_time = 0;
+	uint16_t duration;
+	uint8_t level;
+	uint32_t i;
+
+	state->config = config;
+	state->frame_data = frame_data;
+	state->bit_count = bit_count;
+	state->samplerate = samplerate;
+	state->frame_idx = 0;
+	state->pulse_idx = 0;
+	state->time = 0;
+	state->edge = 0;
+	state->remaining = 0;
+	state->level = 0;
+
+	if (config->bit_fmt == RF_BIT_FMT_RAW) {
+		state->pulse_count = bit_count;
+		state->body_start = config->preamble_bit_count;
+		state->body_end = bit_count - config->trailer_bit_count;
+		frame_time = (uint64_t) config->base_time * (state->body_end - state->body_start);
+		once_time = (uint64_t) config->base_time * (config->preamble_bit_count + config->trailer_bit_count);
+	} else {
+		state->pulse_count = 2 * (uint32_t) bit_count + 4;
+		state->body_start = 0;
+		state->body_end = state->pulse_count;
+		for (i = 0; i < state->pulse_count; i++) {
+			audio_get_pulse(state, i, &level, &duration);
+			frame_time += duration;
+		}
+	}
+
+	if (frame_time == 0) {
+		/* Nothing to render */
+		state->pulse_count = 0;
+		state->frame_idx = config->frame_count;
+	}
+
+	frame_time = (config->frame_count > 0) ? (frame_time * config->frame_count + once_time) : 0;
+	state->total = audio_time_to_samples(frame_time, samplerate);
+}
+
+/*
+ * Get the next run of samples at the same level (at most max samples),
+ * and return its length, or 0 once the whole frame has been rendered
+ */
+size_t audio_render_run(struct audio_render_state *state, size_t max, uint8_t *level) {
+	uint64_t edge;
+	uint16_t duration;
+	size_t count;
+
+	while (state->remaining == 0) {
+		if (state->frame_idx >= state->config->frame_count) {
+			return 0;
+		}
+
+		audio_get_pulse(state, state->pulse_idx, &state->level, &duration);
+
+		if (++state->pulse_idx >= audio_frame_end(state)) {
+			state->pulse_idx = state->body_start;
+			state->frame_idx++;
+		}
+
+		/* The edge is placed from the exact time, so that the error does not accumulate */
+		state->time += duration;
+		edge = audio_time_to_samples(state->time, state->samplerate);
+		state->remaining = edge - state->edge;
+		state->edge = edge;
+	}
+
+	count = (state->remaining < max) ? state->remaining : max;
+	state->remaining -= count;
+	*level = state->level;
+
+	return count;
+}
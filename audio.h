@@ -0,0 +1,52 @@
+/*
+ * rf-ctrl - A command-line tool to control 433MHz OOK based devices
+ * Helper functions for audio (PCM) frame rendering
+ *
+ * Copyright (C) 2018 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _AUDIO_H_
+#define _AUDIO_H_
+
+/*
+ * State of the rendering of a RF frame as a sequence of runs of samples at the same level.
+ * The frame is walked pulse by pulse (HL/LH symbols or RAW bits), and each edge is placed
+ * at the sample nearest to its exact time, so that the rounding error never accumulates.
+ * The preamble of RAW frames is only rendered before the first repetition, and their trailer
+ * after the last one.
+ */
+struct audio_render_state {
+	struct timing_config *config;
+	uint8_t *frame_data;
+	uint16_t bit_count;
+	unsigned int samplerate;
+	uint8_t frame_idx;
+	uint32_t pulse_idx;
+	uint32_t pulse_count; /* per frame */
+	uint32_t body_start; /* pulses, after the preamble */
+	uint32_t body_end; /* pulses, before the trailer */
+	uint64_t time; /* us, end of the current pulse */
+	uint64_t edge; /* samples, end of the current pulse */
+	uint32_t remaining; /* samples left in the current pulse */
+	uint8_t level;
+	size_t total; /* samples */
+};
+
+void audio_render_init(struct audio_render_state *state, struct timing_config *config, uint8_t *frame_data, uint16_t bit_count, unsigned int samplerate);
+size_t audio_render_run(struct audio_render_state *state, size_t max, uint8_t *level);
+
+#endif /* _AUDIO_H_ */
@@ -25,6 +25,7 @@
 #include <string.h>
 
 #include "rf-ctrl.h"
+#include "code-store.h"
 
 #define PROTOCOL_NAME			"Blyss"
 
@@ -39,11 +40,10 @@ uint8_t rolling_code_table[5] = {0x98, 0xDA, 0x1E, 0xE6, 0x67};
 static int blyss_format_cmd(uint8_t *data, size_t data_len, uint32_t remote_code, uint32_t device_code, rf_command_t command) {
 	const int bit_count = 52;
 	uint8_t raw_cmd; 		// 1 bit
-	uint8_t rolling_code_idx = 0;
+	uint8_t rolling_code_idx;
+	uint32_t code;
 	uint8_t timestamp = 0;
 	uint8_t channel = 0;		// 4 bits
-	char data_file_path[STORAGE_PATH_MAX_LEN];
-	FILE * f;
 
 	if (data_len * 8 < bit_count) {
 		fprintf(stderr, "%s: data buffer too small (%lu available, %d needed)\n", PROTOCOL_NAME, (unsigned long) data_len, (bit_count + 7)/8);
@@ -75,28 +75,10 @@ static int blyss_format_cmd(uint8_t *data, size_t data_len, uint32_t remote_code
 	}
 
 	/* Get the current rolling code for that device, remote, and channel */
-	get_storage_path(data_file_path, &blyss_driver);
-	snprintf(data_file_path + strlen(data_file_path), STORAGE_PATH_MAX_LEN, "/%02X.%06X", remote_code, device_code);
-
-	dbg_printf(3, "%s: Data file is %s\n", PROTOCOL_NAME, data_file_path);
-
-	f = fopen(data_file_path, "r+");
-	if (f == NULL) {
-		f = fopen(data_file_path, "w+");
-		if (f == NULL) {
-			fprintf(stderr, "%s: Cannot open %s\n", PROTOCOL_NAME, data_file_path);
-			return -1;
-		}
-	}
-
-	if (fscanf(f, "%01hhX", &rolling_code_idx) != 1) {
-		dbg_printf(2, "%s: Rolling code initialized to 0\n", PROTOCOL_NAME);
+	if (code_store_next(blyss_driver.cmd_name, remote_code, device_code, &code) < 0) {
+		return -1;
 	}
-
-	fseek(f, 0, SEEK_SET);
-	fprintf(f, "%01X\n", (rolling_code_idx + 1) % 5);
-
-	fclose(f);
+	rolling_code_idx = code % sizeof(rolling_code_table);
 
 	dbg_printf(1, "%s: Rolling code index at %u (0x%02X)\n", PROTOCOL_NAME, rolling_code_idx, rolling_code_table[rolling_code_idx]);
 
@@ -0,0 +1,361 @@
+/*
+ * rf-ctrl - A command-line tool to control 433MHz OOK based devices
+ * Rolling code storage, shared by the protocol drivers
+ *
+ * Copyright (C) 2018 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pwd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "rf-ctrl.h"
+#include "code-store.h"
+
+#define CODE_STORE_DIR			".rf-ctrl"
+#define CODE_STORE_FILE			"codes.db"
+
+#define CODE_STORE_MAGIC		0x53434652 // "RFCS"
+#define CODE_STORE_VERSION		1
+#define CODE_STORE_GROW			64 // records
+#define CODE_STORE_PROTOCOL_MAX		16
+#define CODE_STORE_BOOT_ID_PATH		"/proc/sys/kernel/random/boot_id"
+#define CODE_STORE_BOOT_ID_LEN		40
+
+/*
+ * The store is a header followed by fixed-size records, mapped in memory and
+ * shared by all the running instances, every access being done under flock().
+ *
+ * Only the reserved codes are written to the disk right away: a block of
+ * sync_count codes is reserved (and synced) whenever next_code reaches the end
+ * of the previous one. If the system went down since the last access (the boot
+ * ID changed), the codes up to the end of the reserved block may have been used
+ * without next_code reaching the disk, so they are skipped.
+ */
+struct code_store_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t record_count;
+	uint32_t capacity; // records
+	char boot_id[CODE_STORE_BOOT_ID_LEN];
+};
+
+struct code_store_record {
+	char protocol[CODE_STORE_PROTOCOL_MAX];
+	uint32_t remote_code;
+	uint32_t device_code;
+	uint32_t next_code;
+	uint32_t reserved_code; // codes below this one may have been used, on the disk
+};
+
+static int store_fd = -1;
+static struct code_store_header *store = NULL;
+static size_t store_len = 0;
+static unsigned int sync_count = 1;
+static char home_path[STORAGE_PATH_MAX_LEN];
+
+
+static size_t code_store_size(uint32_t capacity) {
+	return sizeof(struct code_store_header) + capacity * sizeof(struct code_store_record);
+}
+
+static struct code_store_record * code_store_records(void) {
+	return (struct code_store_record *) (store + 1);
+}
+
+static void code_store_get_boot_id(char *boot_id) {
+	FILE *f;
+
+	memset(boot_id, 0, CODE_STORE_BOOT_ID_LEN);
+
+	f = fopen(CODE_STORE_BOOT_ID_PATH, "r");
+	if (f == NULL) {
+		return;
+	}
+
+	if (fgets(boot_id, CODE_STORE_BOOT_ID_LEN, f) == NULL) {
+		memset(boot_id, 0, CODE_STORE_BOOT_ID_LEN);
+	}
+
+	fclose(f);
+}
+
+/* Map the whole file, which may have been grown by another instance */
+static int code_store_map(void) {
+	struct stat st;
+
+	if (store != NULL) {
+		munmap(store, store_len);
+		store = NULL;
+	}
+
+	if (fstat(store_fd, &st) < 0) {
+		return -1;
+	}
+
+	store_len = st.st_size;
+	store = mmap(NULL, store_len, PROT_READ | PROT_WRITE, MAP_SHARED, store_fd, 0);
+	if (store == MAP_FAILED) {
+		store = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int code_store_grow(uint32_t capacity) {
+	if (ftruncate(store_fd, code_store_size(capacity)) < 0 || code_store_map() < 0) {
+		return -1;
+	}
+
+	store->capacity = capacity;
+
+	return 0;
+}
+
+static int code_store_sync(void) {
+	return msync(store, store_len, MS_SYNC);
+}
+
+/* Skip the codes that may have been used before the system went down */
+static void code_store_recover(void) {
+	struct code_store_record *records = code_store_records();
+	char boot_id[CODE_STORE_BOOT_ID_LEN];
+	uint32_t i;
+
+	code_store_get_boot_id(boot_id);
+	if (!memcmp(boot_id, store->boot_id, CODE_STORE_BOOT_ID_LEN)) {
+		return;
+	}
+
+	for (i = 0; i < store->record_count; i++) {
+		if (records[i].next_code < records[i].reserved_code) {
+			dbg_printf(2, "Code store: %s %02X.%06X skipping to %04X\n", records[i].protocol,
+				records[i].remote_code, records[i].device_code, records[i].reserved_code);
+			records[i].next_code = records[i].reserved_code;
+		}
+	}
+
+	memcpy(store->boot_id, boot_id, CODE_STORE_BOOT_ID_LEN);
+	code_store_sync();
+}
+
+static int code_store_open(void) {
+	char path[STORAGE_PATH_MAX_LEN];
+	struct passwd *pw;
+
+	pw = getpwuid(getuid());
+	if (pw == NULL) {
+		fprintf(stderr, "Cannot find the home folder to store the rolling codes\n");
+		return -1;
+	}
+
+	if (snprintf(home_path, sizeof(home_path), "%s/%s", pw->pw_dir, CODE_STORE_DIR) >= (int) sizeof(home_path)
+			|| snprintf(path, sizeof(path), "%s/%s", home_path, CODE_STORE_FILE) >= (int) sizeof(path)) {
+		fprintf(stderr, "Home folder path too long to store the rolling codes: %s\n", pw->pw_dir);
+		return -1;
+	}
+
+	store_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (store_fd < 0 && errno == ENOENT) {
+		mkdir(home_path, S_IRWXU);
+		store_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	}
+
+	if (store_fd < 0) {
+		fprintf(stderr, "Cannot open %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	dbg_printf(3, "Code store is %s\n", path);
+
+	flock(store_fd, LOCK_EX);
+
+	if (code_store_map() < 0 && store_len != 0) {
+		goto error;
+	}
+
+	if (store_len == 0) {
+		/* New store */
+		if (code_store_grow(CODE_STORE_GROW) < 0) {
+			goto error;
+		}
+
+		store->magic = CODE_STORE_MAGIC;
+		store->version = CODE_STORE_VERSION;
+		store->record_size = sizeof(struct code_store_record);
+		store->record_count = 0;
+		code_store_get_boot_id(store->boot_id);
+		code_store_sync();
+	} else if (store_len < sizeof(struct code_store_header) || store->magic != CODE_STORE_MAGIC
+			|| store->version != CODE_STORE_VERSION || store->record_size != sizeof(struct code_store_record)
+			|| store_len < code_store_size(store->capacity)) {
+		fprintf(stderr, "%s is not a valid rolling code store\n", path);
+		goto error;
+	}
+
+	code_store_recover();
+
+	flock(store_fd, LOCK_UN);
+
+	return 0;
+
+error:
+	if (store != NULL) {
+		munmap(store, store_len);
+		store = NULL;
+	}
+	close(store_fd);
+	store_fd = -1;
+
+	return -1;
+}
+
+/* Get the code from the file used by the previous versions, if any */
+static uint32_t code_store_import(char *protocol, uint32_t remote_code, uint32_t device_code) {
+	char path[STORAGE_PATH_MAX_LEN];
+	unsigned int code = 0;
+	FILE *f;
+
+	if (snprintf(path, sizeof(path), "%s/%s/%02X.%06X", home_path, protocol, remote_code, device_code) >= (int) sizeof(path)) {
+		fprintf(stderr, "Code store: %s path too long, previous code not imported\n", protocol);
+		return 0;
+	}
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+
+	if (fscanf(f, "%X", &code) == 1) {
+		dbg_printf(2, "Code store: imported %04X from %s\n", code, path);
+	}
+
+	fclose(f);
+
+	return code;
+}
+
+static struct code_store_record * code_store_find(char *protocol, uint32_t remote_code, uint32_t device_code) {
+	struct code_store_record *records = code_store_records();
+	uint32_t i;
+
+	for (i = 0; i < store->record_count; i++) {
+		if (records[i].remote_code == remote_code && records[i].device_code == device_code
+				&& !strncmp(records[i].protocol, protocol, CODE_STORE_PROTOCOL_MAX)) {
+			return &records[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct code_store_record * code_store_add(char *protocol, uint32_t remote_code, uint32_t device_code) {
+	struct code_store_record *record;
+
+	if (store->record_count >= store->capacity && code_store_grow(store->capacity + CODE_STORE_GROW) < 0) {
+		return NULL;
+	}
+
+	record = &code_store_records()[store->record_count];
+	memset(record, 0, sizeof(*record));
+	strncpy(record->protocol, protocol, CODE_STORE_PROTOCOL_MAX - 1);
+	record->remote_code = remote_code;
+	record->device_code = device_code;
+	record->next_code = code_store_import(protocol, remote_code, device_code);
+	record->reserved_code = record->next_code;
+
+	store->record_count++;
+
+	return record;
+}
+
+/*
+ * Get the next rolling code for a device of a protocol (starting at 0 and
+ * wrapping at 2^32, the protocol keeping the bits it needs), never given twice
+ */
+int code_store_next(char *protocol, uint32_t remote_code, uint32_t device_code, uint32_t *code) {
+	struct code_store_record *record;
+	int ret = -1;
+
+	if (store == NULL && code_store_open() < 0) {
+		return -1;
+	}
+
+	flock(store_fd, LOCK_EX);
+
+	/* Another instance may have added records */
+	if (code_store_size(store->capacity) > store_len && code_store_map() < 0) {
+		goto exit;
+	}
+
+	record = code_store_find(protocol, remote_code, device_code);
+	if (record == NULL) {
+		record = code_store_add(protocol, remote_code, device_code);
+		if (record == NULL) {
+			fprintf(stderr, "Cannot add %s %02X.%06X to the code store (%s)\n", protocol, remote_code, device_code, strerror(errno));
+			goto exit;
+		}
+	}
+
+	*code = record->next_code++;
+
+	/* Reserve the next block, which has to reach the disk before the code is used */
+	if (record->next_code > record->reserved_code) {
+		record->reserved_code = *code + sync_count;
+		if (code_store_sync() < 0) {
+			fprintf(stderr, "Cannot write the code store (%s)\n", strerror(errno));
+			record->next_code = *code;
+			goto exit;
+		}
+	}
+
+	ret = 0;
+
+exit:
+	flock(store_fd, LOCK_UN);
+
+	return ret;
+}
+
+/* Number of codes reserved (and written) at once, at most that number minus 1 being skipped after a crash */
+void code_store_set_sync(unsigned int count) {
+	sync_count = (count > 0) ? count : 1;
+}
+
+void code_store_close(void) {
+	if (store != NULL) {
+		munmap(store, store_len);
+		store = NULL;
+	}
+
+	if (store_fd >= 0) {
+		close(store_fd);
+		store_fd = -1;
+	}
+}
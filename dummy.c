@@ -53,6 +53,15 @@ static void dbg_printnc(int level, char c, uint16_t n) {
 	}
 }
 
+/* RAW bits, as sent once before or after the repeated ones */
+static void dbg_printbits(int level, uint8_t *frame_data, uint16_t first, uint16_t last) {
+	uint16_t i;
+
+	for (i = first; i < last; i++) {
+		dbg_printnc(level, (frame_data[i/8] & (1 << (7 - (i % 8)))) ? H_CHAR : L_CHAR, 1);
+	}
+}
+
 static int dummy_send_cmd(struct timing_config *config, uint8_t *frame_data, uint16_t bit_count) {
 	uint16_t i;
 
@@ -62,6 +71,12 @@ static int dummy_send_cmd(struct timing_config *config, uint8_t *frame_data, uin
 
 	dbg_printf(1, "%s: Count = %u\n", HARDWARE_NAME, config->frame_count);
 
+	if (config->preamble_bit_count > 0) {
+		dbg_printf(1, "%s: Preamble = ", HARDWARE_NAME);
+		dbg_printbits(1, frame_data, 0, config->preamble_bit_count);
+		dbg_printf(1, "\n");
+	}
+
 	dbg_printf(1, "%s: Frame = ", HARDWARE_NAME);
 	switch (config->bit_fmt) {
 		case RF_BIT_FMT_HL:
@@ -75,7 +90,7 @@ static int dummy_send_cmd(struct timing_config *config, uint8_t *frame_data, uin
 			break;
 	}
 
-	for (i = 0; i < bit_count; i++) {
+	for (i = config->preamble_bit_count; i < (bit_count - config->trailer_bit_count); i++) {
 		if (frame_data[i/8] & (1 << (7 - (i % 8)))) {
 			switch (config->bit_fmt) {
 				case RF_BIT_FMT_HL:
@@ -127,14 +142,27 @@ static int dummy_send_cmd(struct timing_config *config, uint8_t *frame_data, uin
 
 	dbg_printf(1, "\n");
 
+	if (config->trailer_bit_count > 0) {
+		dbg_printf(1, "%s: Trailer = ", HARDWARE_NAME);
+		dbg_printbits(1, frame_data, bit_count - config->trailer_bit_count, bit_count);
+		dbg_printf(1, "\n");
+	}
+
 	return 0;
 }
 
+/* What is printed, rather than transmitted */
+static struct rf_hardware_caps dummy_caps = {
+	.time_step = BASE_TIME_HL,
+	.segmented_frames = 1,
+};
+
 struct rf_hardware_driver dummy_driver = {
 	.name = HARDWARE_NAME,
 	.cmd_name = "dummy",
 	.long_name = "Dummy Hardware",
 	.supported_bit_fmts = (1 << RF_BIT_FMT_HL) | (1 << RF_BIT_FMT_LH) | (1 << RF_BIT_FMT_RAW),
+	.caps = &dummy_caps,
 	.probe = &dummy_probe,
 	.init = &dummy_init,
 	.close = &dummy_close,
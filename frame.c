@@ -0,0 +1,236 @@
+/*
+ * rf-ctrl - A command-line tool to control 433MHz OOK based devices
+ * Helper functions for frame format conversion
+ *
+ * Copyright (C) 2018 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rf-ctrl.h"
+#include "raw.h"
+#include "frame.h"
+
+/* Start bit, data bits and end bit, one H and one L pulse each */
+#define FRAME_PULSES_MAX(bit_count)	(2 * ((size_t) (bit_count) + 2))
+
+struct frame_pulse {
+	uint8_t level;
+	uint32_t duration; // us
+};
+
+struct frame_symbol {
+	uint32_t h_time; // us
+	uint32_t l_time; // us
+};
+
+
+static uint8_t frame_get_bit(uint8_t *data, uint32_t idx) {
+	return (data[idx/8] & (1 << (7 - (idx % 8)))) != 0;
+}
+
+/* Append a pulse, merged with the previous one if at the same level */
+static void frame_add_pulse(struct frame_pulse *pulses, size_t *count, uint8_t level, uint32_t duration) {
+	if (duration == 0) {
+		return;
+	}
+
+	if (*count > 0 && pulses[*count - 1].level == level) {
+		pulses[*count - 1].duration += duration;
+		return;
+	}
+
+	pulses[*count].level = level;
+	pulses[*count].duration = duration;
+	(*count)++;
+}
+
+/*
+ * Rewrite a LH frame as a HL frame producing exactly the same signal.
+ *
+ * The L pulse of each symbol becomes the L pulse of the previous one, so the
+ * start bit is made of the start H pulse and the L pulse of the first data bit,
+ * and so on. The leading L pulse of the frame is folded at its end: it makes
+ * the gap before the next repetition, and is idle time before the first one.
+ *
+ * The resulting symbols depend on two consecutive bits, so this only works
+ * when the frame needs no more than two different data symbols (e.g. when the
+ * data bits share their L or H time). -1 is returned otherwise, as the frame
+ * cannot be sent exactly.
+ */
+int frame_lh_to_hl(struct timing_config *dest_config, uint8_t *dest_frame_data, size_t dest_data_len, struct timing_config *config, uint8_t *src_frame_data, uint16_t src_bit_count) {
+	struct frame_pulse *pulses;
+	struct frame_symbol symbols[2];
+	struct frame_symbol start = {0}, end = {0}, cur;
+	size_t pulse_count = 0, lead = 0;
+	size_t symbol_count = 0, bit_count = 0;
+	size_t i, s;
+	int ret = -1;
+
+	if (config->bit_fmt != RF_BIT_FMT_LH) {
+		return -1;
+	}
+
+	/* One more for the final L pulse */
+	pulses = malloc((FRAME_PULSES_MAX(src_bit_count) + 1) * sizeof(*pulses));
+	if (pulses == NULL) {
+		return -1;
+	}
+
+	/* The signal of the whole frame, without empty pulses */
+	frame_add_pulse(pulses, &pulse_count, 0, config->start_bit_l_time);
+	frame_add_pulse(pulses, &pulse_count, 1, config->start_bit_h_time);
+	for (i = 0; i < src_bit_count; i++) {
+		if (frame_get_bit(src_frame_data, i)) {
+			frame_add_pulse(pulses, &pulse_count, 0, config->data_bit1_l_time);
+			frame_add_pulse(pulses, &pulse_count, 1, config->data_bit1_h_time);
+		} else {
+			frame_add_pulse(pulses, &pulse_count, 0, config->data_bit0_l_time);
+			frame_add_pulse(pulses, &pulse_count, 1, config->data_bit0_h_time);
+		}
+	}
+	frame_add_pulse(pulses, &pulse_count, 0, config->end_bit_l_time);
+	frame_add_pulse(pulses, &pulse_count, 1, config->end_bit_h_time);
+
+	/* Fold the leading L pulse at the end */
+	if (pulse_count > 0 && pulses[0].level == 0) {
+		lead = 1;
+		frame_add_pulse(pulses, &pulse_count, 0, pulses[0].duration);
+	}
+
+	/* The last H pulse may be followed by nothing */
+	if (pulse_count > 0 && pulses[pulse_count - 1].level == 1) {
+		pulses[pulse_count].level = 0;
+		pulses[pulse_count].duration = 0;
+		pulse_count++;
+	}
+
+	/* A start symbol, an end symbol, and data symbols in between */
+	if (pulse_count - lead < 4) {
+		dbg_printf(2, "  LH to HL: Frame too short\n");
+		goto exit;
+	}
+
+	if ((pulse_count - lead)/2 - 2 > dest_data_len * 8) {
+		dbg_printf(2, "  LH to HL: Frame too long\n");
+		goto exit;
+	}
+
+	memset(dest_frame_data, 0, dest_data_len);
+
+	for (i = lead; i < pulse_count; i += 2) {
+		cur.h_time = pulses[i].duration;
+		cur.l_time = pulses[i + 1].duration;
+
+		if (cur.h_time > UINT16_MAX || cur.l_time > UINT16_MAX) {
+			dbg_printf(2, "  LH to HL: Pulse too long\n");
+			goto exit;
+		}
+
+		if (i == lead) {
+			start = cur;
+			continue;
+		} else if (i + 2 == pulse_count) {
+			end = cur;
+			continue;
+		}
+
+		for (s = 0; s < symbol_count; s++) {
+			if (symbols[s].h_time == cur.h_time && symbols[s].l_time == cur.l_time) {
+				break;
+			}
+		}
+
+		if (s == symbol_count) {
+			if (symbol_count == sizeof(symbols)/sizeof(symbols[0])) {
+				dbg_printf(2, "  LH to HL: More than two data symbols needed\n");
+				goto exit;
+			}
+
+			symbols[symbol_count++] = cur;
+		}
+
+		if (s) {
+			dest_frame_data[bit_count/8] |= 1 << (7 - (bit_count % 8));
+		}
+		bit_count++;
+	}
+
+	/* Unused symbols */
+	for (s = symbol_count; s < sizeof(symbols)/sizeof(symbols[0]); s++) {
+		symbols[s] = (symbol_count > 0) ? symbols[0] : end;
+	}
+
+	*dest_config = *config;
+	dest_config->start_bit_h_time = start.h_time;
+	dest_config->start_bit_l_time = start.l_time;
+	dest_config->end_bit_h_time = end.h_time;
+	dest_config->end_bit_l_time = end.l_time;
+	dest_config->data_bit0_h_time = symbols[0].h_time;
+	dest_config->data_bit0_l_time = symbols[0].l_time;
+	dest_config->data_bit1_h_time = symbols[1].h_time;
+	dest_config->data_bit1_l_time = symbols[1].l_time;
+	dest_config->bit_fmt = RF_BIT_FMT_HL;
+
+	ret = bit_count;
+
+exit:
+	free(pulses);
+
+	return ret;
+}
+
+/*
+ * Unroll a RAW frame made of a preamble, a repeated part and a trailer into
+ * a frame sent once, for the hardware drivers not handling these segments
+ */
+int frame_unroll(struct timing_config *dest_config, uint8_t *dest_frame_data, size_t dest_data_len, struct timing_config *config, uint8_t *src_frame_data, uint16_t src_bit_count) {
+	uint16_t body_start = config->preamble_bit_count;
+	uint16_t body_end = src_bit_count - config->trailer_bit_count;
+	size_t count = 0;
+	uint16_t first, last;
+	uint8_t i;
+
+	if (config->frame_count > 0) {
+		count = src_bit_count + (config->frame_count - 1) * (body_end - body_start);
+	}
+
+	if (count > (dest_data_len * 8)) {
+		fprintf(stderr, "Buffer too small (%lu bits) to unroll this frame (%lu bits)\n", (unsigned long) (dest_data_len * 8), (unsigned long) count);
+		return -1;
+	}
+
+	/* The first repetition starts with the preamble, and the last one ends with the trailer */
+	count = 0;
+	for (i = 0; i < config->frame_count; i++) {
+		first = (i == 0) ? 0 : body_start;
+		last = (i == config->frame_count - 1) ? src_bit_count : body_end;
+		count += raw_copy_bits(dest_frame_data, count, src_frame_data, first, last - first);
+	}
+
+	/* The whole sequence is repeated, instead of the part after the preamble */
+	*dest_config = *config;
+	dest_config->frame_count = (config->frame_count > 0) ? ((config->sequence_count > 1) ? config->sequence_count : 1) : 0;
+	dest_config->preamble_bit_count = 0;
+	dest_config->trailer_bit_count = 0;
+	dest_config->sequence_count = 0;
+
+	return count;
+}
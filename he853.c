@@ -24,6 +24,10 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <wchar.h>
 
 #include "rf-ctrl.h"
 #include "hidapi.h"
@@ -33,6 +37,8 @@
 #define HE853_PID		0x1357
 #define HE853_VID		0x04d9
 
+#define HE853_USB_DEV_ROOT	"/dev/bus/usb"
+
 #define HE853_CMD_TIMING1	0x01
 #define HE853_CMD_TIMING2	0x02
 #define HE853_CMD_DATA1		0x03
@@ -41,188 +47,728 @@
 
 #define HE853_DATA_LEN_MAX	14
 
+#define HE853_REPORT_LEN	8
+#define HE853_HID_REPORT_LEN	(HE853_REPORT_LEN + 1) // with the report id
+#define HE853_CONFIG_REPORTS	4 // TIMING1, TIMING2, DATA1 and DATA2
+
 #define MAX_HID_WRITE_ATTEMPT	5
+#define MAX_REATTACH_ATTEMPT	3 // per command
+#define REATTACH_TIMEOUT	30000 // ms
+#define REATTACH_POLL_PERIOD	500 // ms, between two attempts to open the device again
 
-hid_device *handle = NULL;
+#define HE853_CAL_POINTS_MAX	64
+#define HE853_CAL_ERROR_MAX	10 // %, reported past this
+#define HE853_UNIT_TIME		10 // us, nominal
 
+#define HE853_SETUP_TIME	5000 // us, configuration and EXECUTE reports
 
-static int he853_probe(void) {
-	hid_device *h;
+#define HE853_INSTANCE_MAX	8
+#define HE853_PATH_MAX		64
+#define HE853_SERIAL_MAX	64
 
-	h = hid_open(HE853_VID, HE853_PID, NULL);
+struct he853_cal_point {
+	uint16_t usec;
+	uint16_t units;
+};
 
-	if (!h) {
-		dbg_printf(2, "%s not detected\n", HARDWARE_NAME);
+struct he853_cal_table {
+	char *name;
+	struct he853_cal_point points[HE853_CAL_POINTS_MAX];
+	unsigned int count;
+};
+
+struct he853_instance {
+	/* Empty when opened by VID/PID */
+	char path[HE853_PATH_MAX];
+	wchar_t serial[HE853_SERIAL_MAX];
+
+	/* NULL when the device was lost */
+	hid_device *handle;
+
+	/* Configuration reports last written to the dongle, so that only the ones that changed are sent again */
+	uint8_t report_cache[HE853_CONFIG_REPORTS][HE853_REPORT_LEN];
+	uint8_t report_cache_valid; // 1 bit per report
+
+	/* Estimated end of the current transmission (us, monotonic clock) */
+	uint64_t busy_until;
+};
+
+static struct he853_instance instances[HE853_INSTANCE_MAX];
+static unsigned int instance_count = 0;
+
+/* Instance that received the last frame */
+static unsigned int last_instance = 0;
+
+/* Device opened when probing, used by init if no device is selected */
+static hid_device *probed_handle = NULL;
+
+/* Hotplug notifications, to open the device again as soon as it comes back */
+static int hotplug_handle = -1;
+static volatile int device_arrived = 0;
+
+
+/*
+ * The HE853 dongle is supposed to take timing values
+ * in 10 us unit, but it appears it does not work for
+ * "low" ( < 9000 us) values, and the resulting timings
+ * also differ between H and L values.
+ *
+ * The timings are converted using calibration tables of measured
+ * durations, taken as is for the measured points, interpolated between
+ * them, and extended past the last one with the nominal 10 us unit.
+ * The measured values do not always grow with the durations (L time
+ * around 400 us).
+ */
+static struct he853_cal_table htime_table = {
+	.name = "H",
+	.points = {
+		{ 0, 0x00 },
+		{ 160, 0x25 },
+		{ 220, 0x2A },
+		{ 260, 0x2D },
+		{ 400, 0x30 },
+		{ 420, 0x33 },
+		{ 700, 0x5C },
+		{ 1100, 0x76 },
+	},
+	.count = 8,
+};
+
+static struct he853_cal_table ltime_table = {
+	.name = "L",
+	.points = {
+		{ 0, 0x00 },
+		{ 160, 0x04 },
+		{ 260, 0x09 },
+		{ 320, 0x0C },
+		{ 400, 0x1F },
+		{ 420, 0x18 },
+		{ 800, 0x3C },
+		{ 1100, 0x63 },
+		{ 1300, 0x68 },
+		{ 2680, 0xF8 },
+		{ 4860, 0x01E0 },
+		{ 7440, 0x02E3 },
+		{ 8600, 0x035A },
+		{ 9000, 0x0384 },
+		{ 10400, 0x0410 },
+	},
+	.count = 15,
+};
+
+static int he853_compare_points(const void *a, const void *b) {
+	const struct he853_cal_point *point_a = a;
+	const struct he853_cal_point *point_b = b;
+
+	return (int) point_a->usec - (int) point_b->usec;
+}
+
+/* Add a measurement to a table, the durations measured for the same value being averaged */
+static int he853_add_cal_point(struct he853_cal_table *table, uint32_t *sums, unsigned int *samples, uint32_t usec, uint16_t units) {
+	unsigned int i;
+
+	for (i = 0; i < table->count; i++) {
+		if (table->points[i].units == units) {
+			break;
+		}
+	}
+
+	if (i == table->count) {
+		if (table->count >= HE853_CAL_POINTS_MAX) {
+			return -1;
+		}
+
+		table->points[i].units = units;
+		sums[i] = 0;
+		samples[i] = 0;
+		table->count++;
+	}
+
+	sums[i] += usec;
+	samples[i]++;
+	table->points[i].usec = (sums[i] + samples[i]/2) / samples[i];
+
+	return 0;
+}
+
+/*
+ * Load calibration tables, made of "<H|L> <us> <value>" lines, e.g. the
+ * durations measured on a capture of frames sent with known values.
+ * Measurements of the same value are averaged, and a table found in the
+ * file replaces the built-in one.
+ */
+static int he853_load_calibration(const char *path) {
+	struct he853_cal_table tables[2] = { { .name = "H" }, { .name = "L" } };
+	uint32_t sums[2][HE853_CAL_POINTS_MAX];
+	unsigned int samples[2][HE853_CAL_POINTS_MAX];
+	char line[128];
+	char type;
+	unsigned int usec, units;
+	int line_num = 0;
+	FILE *f;
+	unsigned int i, j;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "%s: Cannot open calibration file %s (%s)\n", HARDWARE_NAME, path, strerror(errno));
 		return -1;
 	}
 
-	hid_close(h);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line_num++;
 
-	dbg_printf(2, "%s detected\n", HARDWARE_NAME);
+		if (sscanf(line, " %c", &type) != 1 || type == '#') {
+			continue;
+		}
+
+		if (sscanf(line, " %c %u %i", &type, &usec, &units) != 3 || (type != 'H' && type != 'L')
+				|| usec > UINT16_MAX || units > UINT16_MAX) {
+			fprintf(stderr, "%s: Invalid calibration line %d in %s\n", HARDWARE_NAME, line_num, path);
+			fclose(f);
+			return -1;
+		}
+
+		i = (type == 'H') ? 0 : 1;
+		if (he853_add_cal_point(&tables[i], sums[i], samples[i], usec, units) < 0) {
+			fprintf(stderr, "%s: Too many calibration points in %s\n", HARDWARE_NAME, path);
+			fclose(f);
+			return -1;
+		}
+	}
+
+	fclose(f);
+
+	for (i = 0; i < 2; i++) {
+		if (tables[i].count == 0) {
+			continue;
+		}
+
+		/* No value means no pulse, unless measured otherwise */
+		for (j = 0; j < tables[i].count; j++) {
+			if (tables[i].points[j].units == 0) {
+				break;
+			}
+		}
+		if (j == tables[i].count && he853_add_cal_point(&tables[i], sums[i], samples[i], 0, 0) < 0) {
+			tables[i].count--;
+		}
+
+		if (tables[i].count < 2) {
+			fprintf(stderr, "%s: Not enough %s calibration points in %s\n", HARDWARE_NAME, tables[i].name, path);
+			return -1;
+		}
+
+		qsort(tables[i].points, tables[i].count, sizeof(tables[i].points[0]), &he853_compare_points);
+
+		/* Different values measured with the same duration leave nothing to interpolate */
+		for (j = 1; j < tables[i].count; j++) {
+			if (tables[i].points[j].usec == tables[i].points[j - 1].usec) {
+				fprintf(stderr, "%s: Several %s calibration values at %u us in %s\n", HARDWARE_NAME, tables[i].name, tables[i].points[j].usec, path);
+				return -1;
+			}
+		}
+
+		if (i == 0) {
+			htime_table = tables[i];
+		} else {
+			ltime_table = tables[i];
+		}
+	}
+
+	if (is_dbg_enabled(3)) {
+		dbg_printf(3, "%s: Calibration loaded from %s\n", HARDWARE_NAME, path);
+		for (i = 0; i < htime_table.count; i++) {
+			dbg_printf(3, "  H %u 0x%04X\n", htime_table.points[i].usec, htime_table.points[i].units);
+		}
+		for (i = 0; i < ltime_table.count; i++) {
+			dbg_printf(3, "  L %u 0x%04X\n", ltime_table.points[i].usec, ltime_table.points[i].units);
+		}
+	}
 
 	return 0;
 }
 
-static int he853_init(struct rf_hardware_params *params) {
-	if (handle != NULL) {
-		dbg_printf(1, "%s device already initialized\n", HARDWARE_NAME);
+/* Convert a duration to the nearest dongle value, and give the duration actually obtained */
+static uint16_t he853_cal_convert(struct he853_cal_table *table, uint16_t usec, uint16_t max, int64_t *actual) {
+	struct he853_cal_point *p0, *p1;
+	int64_t units, dx, du;
+	unsigned int i;
+
+	if (usec == 0) {
+		*actual = 0;
 		return 0;
 	}
 
-	handle = hid_open(HE853_VID, HE853_PID, NULL);
+	for (i = 1; i < table->count - 1; i++) {
+		if (table->points[i].usec >= usec) {
+			break;
+		}
+	}
 
-	if (!handle) {
-		fprintf(stderr, "%s: Unable to open device\n", HARDWARE_NAME);
+	p0 = &table->points[i - 1];
+	p1 = &table->points[i];
+
+	if (usec == p1->usec) {
+		/* Measured point */
+		units = p1->units;
+	} else if (usec > p1->usec) {
+		/* Past the last point, with the nominal unit */
+		units = p1->units + (usec - p1->usec + HE853_UNIT_TIME/2) / HE853_UNIT_TIME;
+	} else {
+		/* Interpolated, rounded to the nearest value */
+		dx = p1->usec - p0->usec;
+		du = (int64_t) p1->units - p0->units;
+		units = p0->units * dx + (usec - p0->usec) * du;
+		units = (units + dx/2) / dx;
+	}
+
+	if (units > max) {
+		units = max;
+	}
+
+	/* Duration actually obtained with this value */
+	if (units > p1->units && p1 == &table->points[table->count - 1]) {
+		*actual = p1->usec + (units - p1->units) * HE853_UNIT_TIME;
+	} else if (p1->units != p0->units) {
+		*actual = p0->usec + (units - p0->units) * ((int64_t) p1->usec - p0->usec) / ((int64_t) p1->units - p0->units);
+	} else {
+		*actual = usec;
+	}
+
+	return units;
+}
+
+/* Convert a duration to the nearest dongle value, and report the error */
+static uint16_t to_he853_time(struct he853_cal_table *table, uint16_t usec, uint16_t max) {
+	uint16_t units;
+	int64_t actual;
+
+	if (usec == 0) {
+		return 0;
+	}
+
+	units = he853_cal_convert(table, usec, max, &actual);
+
+	dbg_printf(3, "  %s: %u us as %s time: 0x%04X (%lld us)\n", HARDWARE_NAME, usec, table->name, (unsigned int) units, (long long) actual);
+
+	if (llabs(actual - usec) * 100 > (int64_t) usec * HE853_CAL_ERROR_MAX) {
+		fprintf(stderr, "%s: %u us is not supported as %s time, %lld us used instead !\n", HARDWARE_NAME, usec, table->name, (long long) actual);
+	}
+
+	return units;
+}
+
+/* Duration actually sent for a pulse, so that the frames are routed on the calibrated timings */
+static uint32_t he853_quantize_time(uint32_t time, uint8_t high) {
+	int64_t actual;
+
+	if (time > UINT16_MAX) {
+		time = UINT16_MAX;
+	}
+
+	he853_cal_convert(high ? &htime_table : &ltime_table, time, UINT16_MAX, &actual);
+
+	return (actual > 0) ? (uint32_t) actual : 0;
+}
+
+static uint64_t he853_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void he853_hotplug(unsigned short vendor_id, unsigned short product_id, int event, void *user_data) {
+	(void) vendor_id;
+	(void) product_id;
+	(void) user_data;
+
+	if (event == HID_HOTPLUG_ARRIVED) {
+		device_arrived = 1;
+	}
+}
+
+static int he853_probe(void) {
+	if (probed_handle == NULL) {
+		/* The dongle is never read from */
+		probed_handle = hid_open_flags(HE853_VID, HE853_PID, NULL, HID_OPEN_WRITE_ONLY);
+	}
+
+	if (!probed_handle) {
+		dbg_printf(2, "%s not detected\n", HARDWARE_NAME);
 		return -1;
 	}
 
+	/* Keep the device open, init will use it instead of opening it again */
+	dbg_printf(2, "%s detected\n", HARDWARE_NAME);
+
 	return 0;
 }
 
-static void he853_close(void) {
-	hid_close(handle);
+/* The USB device node of the probed dongle, which goes away when it is unplugged */
+static int he853_get_probe_path(char *path, size_t len) {
+	unsigned char bus, address;
+
+	if (hid_get_usb_location(probed_handle, &bus, &address) < 0) {
+		return -1;
+	}
 
-	handle = NULL;
+	snprintf(path, len, "%s/%03u/%03u", HE853_USB_DEV_ROOT, bus, address);
+
+	return 0;
 }
 
-static int he853_send_hid_report(uint8_t* buf) {
-	uint8_t obuf[9];
-	int ret = 0;
-	int i, retry_count = 0;
+/* Whether a device is already used by another instance */
+static int he853_path_in_use(const char *path, struct he853_instance *except) {
+	unsigned int i;
 
-	obuf[0] = 0x00; // report id = 0, as it seems to be the only report
+	for (i = 0; i < instance_count; i++) {
+		if (&instances[i] != except && instances[i].handle != NULL && !strcmp(instances[i].path, path)) {
+			return 1;
+		}
+	}
 
-	for (i = 0; i < 8; i++) {
-		obuf[i + 1] = buf[i];
+	return 0;
+}
+
+/* Open an instance, by path if selected by name, otherwise the first dongle found */
+static int he853_open_instance(struct he853_instance *inst, struct hid_device_info *devs) {
+	struct hid_device_info *cur_dev;
+
+	if (inst->path[0] == '\0') {
+		inst->handle = hid_open_flags(HE853_VID, HE853_PID, NULL, HID_OPEN_WRITE_ONLY);
+		return (inst->handle != NULL) ? 0 : -1;
 	}
 
-	if (is_dbg_enabled(2)) {
-		dbg_printf(2, "  %s HID report: ", HARDWARE_NAME);
-		for (i = 0; i < 9; i++) {
-			dbg_printf(2, "%02X ", obuf[i]);
+	/* The path changes when the device comes back, so look for the same serial number, or any dongle not used yet */
+	for (cur_dev = devs; cur_dev != NULL; cur_dev = cur_dev->next) {
+		if (he853_path_in_use(cur_dev->path, inst)) {
+			continue;
 		}
-		dbg_printf(2, "\n");
-	}
 
-	while (retry_count < MAX_HID_WRITE_ATTEMPT) {
-		ret = hid_write(handle, obuf, 9);
-		if (ret < 0) {
-			retry_count++;
-			dbg_printf(2, "%s: Warning, hid_write failed, retrying (%d)...\n", HARDWARE_NAME, retry_count);
-		} else {
+		if (inst->serial[0] == L'\0' || (cur_dev->serial_number != NULL && !wcscmp(inst->serial, cur_dev->serial_number))) {
 			break;
 		}
 	}
 
-	if (ret < 0) {
-		fprintf(stderr, "%s: Cannot send HID report, hid_write failed (id %d, command %d) !\n", HARDWARE_NAME, obuf[0], obuf[1]);
+	if (cur_dev == NULL) {
+		return -1;
 	}
 
-	return ret;
+	inst->handle = hid_open_path_flags(cur_dev->path, HID_OPEN_WRITE_ONLY);
+	if (inst->handle == NULL) {
+		return -1;
+	}
+
+	snprintf(inst->path, HE853_PATH_MAX, "%s", cur_dev->path);
+
+	return 0;
 }
 
-static int he853_send_rf_frame(void) {
-	uint8_t cmd_buf[8];
+static int he853_add_instance(struct hid_device_info *dev) {
+	struct he853_instance *inst;
 
-	memset(cmd_buf, 0x00, sizeof(cmd_buf));
-	cmd_buf[0] = HE853_CMD_EXECUTE;
+	if (instance_count >= HE853_INSTANCE_MAX) {
+		fprintf(stderr, "%s: Too many dongles, ignoring %s\n", HARDWARE_NAME, dev->path);
+		return -1;
+	}
+
+	if (he853_path_in_use(dev->path, NULL)) {
+		return 0;
+	}
+
+	inst = &instances[instance_count];
+	memset(inst, 0, sizeof(*inst));
+
+	snprintf(inst->path, HE853_PATH_MAX, "%s", dev->path);
+	if (dev->serial_number != NULL) {
+		wcsncpy(inst->serial, dev->serial_number, HE853_SERIAL_MAX - 1);
+	}
+
+	inst->handle = hid_open_path_flags(dev->path, HID_OPEN_WRITE_ONLY);
+	if (inst->handle == NULL) {
+		fprintf(stderr, "%s: Unable to open device %s\n", HARDWARE_NAME, dev->path);
+		return -1;
+	}
+
+	instance_count++;
 
-	return he853_send_hid_report(cmd_buf);
+	return 0;
 }
 
 /*
- * The HE853 dongle is supposed to take timing values
- * in 10 us unit, but it appears it does not work for
- * "low" ( < 9000 us) values, and the resulting timings
- * also differ between H and L values.
+ * Parse a comma-separated list of dongles. Each of them can be a hidapi
+ * path (as reported at -vv) or a serial number. "all" selects every dongle found.
  */
-static uint16_t to_he853_htime(uint16_t usec) {
-	switch (usec/10) {
-		case 0:
-			return 0x00;
+static int he853_select_instances(const char *device) {
+	struct hid_device_info *devs, *cur_dev;
+	char *list, *name, *saveptr;
+	wchar_t serial[HE853_SERIAL_MAX];
+	int ret = 0;
 
-		case 16:
-			return 0x25;
+	devs = hid_enumerate(HE853_VID, HE853_PID);
 
-		case 22:
-			return 0x2A;
+	list = strdup(device);
+	if (list == NULL) {
+		fprintf(stderr, "%s: Cannot allocate the device list\n", HARDWARE_NAME);
+		hid_free_enumeration(devs);
+		return -1;
+	}
 
-		case 26:
-			return 0x2D;
+	for (name = strtok_r(list, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+		while (*name == ' ' || *name == '\t') {
+			name++;
+		}
 
-		case 40:
-			return 0x30;
+		if (mbstowcs(serial, name, HE853_SERIAL_MAX) == (size_t) -1) {
+			serial[0] = L'\0';
+		}
+		serial[HE853_SERIAL_MAX - 1] = L'\0';
+
+		for (cur_dev = devs; cur_dev != NULL; cur_dev = cur_dev->next) {
+			if (strcmp(name, "all") && strcmp(name, cur_dev->path)
+					&& (cur_dev->serial_number == NULL || wcscmp(serial, cur_dev->serial_number))) {
+				continue;
+			}
+
+			if (he853_add_instance(cur_dev) < 0) {
+				ret = -1;
+				break;
+			}
+
+			if (strcmp(name, "all")) {
+				break;
+			}
+		}
 
-		case 42:
-			return 0x33;
+		if (ret == 0 && cur_dev == NULL && strcmp(name, "all")) {
+			fprintf(stderr, "%s: No device matching %s\n", HARDWARE_NAME, name);
+			ret = -1;
+		}
 
-		case 70:
-			return 0x5C;
+		if (ret < 0) {
+			break;
+		}
+	}
 
-		case 110:
-			return 0x76;
+	free(list);
+	hid_free_enumeration(devs);
 
-		default:
-			fprintf(stderr, "%s: %d us is not supported as H time !\n", HARDWARE_NAME, usec);
-			return 0;
+	return ret;
+}
+
+static void he853_close(void) {
+	unsigned int i;
+
+	hid_hotplug_deregister(hotplug_handle);
+	hotplug_handle = -1;
+
+	for (i = 0; i < instance_count; i++) {
+		hid_close(instances[i].handle);
 	}
+
+	instance_count = 0;
+
+	hid_close(probed_handle);
+	probed_handle = NULL;
 }
 
-static uint16_t to_he853_ltime(uint16_t usec) {
-	switch (usec/10) {
-		case 0:
-			return 0x00;
+static int he853_init(struct rf_hardware_params *params) {
+	unsigned int i;
+	int ret = 0;
 
-		case 16:
-			return 0x04;
+	if (instance_count > 0) {
+		dbg_printf(1, "%s device already initialized\n", HARDWARE_NAME);
+		return 0;
+	}
 
-		case 26:
-			return 0x09;
+	if (params->he853_calibration != NULL && he853_load_calibration(params->he853_calibration) < 0) {
+		return -1;
+	}
 
-		case 32:
-			return 0x0C;
+	if (params->provided_params & PARAM_HW_DEVICE) {
+		/* Not the one we want, maybe */
+		hid_close(probed_handle);
+		probed_handle = NULL;
+
+		ret = he853_select_instances(params->device);
+	} else {
+		/* Only use the first dongle found by default */
+		memset(&instances[0], 0, sizeof(instances[0]));
+
+		if (probed_handle != NULL) {
+			/* Already opened when probing */
+			dbg_printf(3, "%s device already opened\n", HARDWARE_NAME);
+			instances[0].handle = probed_handle;
+			probed_handle = NULL;
+		} else {
+			/* The dongle is never read from */
+			instances[0].handle = hid_open_flags(HE853_VID, HE853_PID, NULL, HID_OPEN_WRITE_ONLY);
+		}
 
-		case 40:
-			return 0x1F;
+		if (instances[0].handle != NULL) {
+			instance_count = 1;
+		}
+	}
 
-		case 42:
-			return 0x18;
+	if (ret < 0 || instance_count == 0) {
+		fprintf(stderr, "%s: Unable to open device\n", HARDWARE_NAME);
+		he853_close();
+		return -1;
+	}
 
-		case 80:
-			return 0x3C;
+	for (i = 0; i < instance_count; i++) {
+		if (instances[i].path[0] != '\0') {
+			printf("%s: Using %s\n", HARDWARE_NAME, instances[i].path);
+		}
+	}
 
-		case 110:
-			return 0x63;
+	last_instance = instance_count - 1;
 
-		case 130:
-			return 0x68;
+	/* Not fatal, the device is polled for when lost otherwise */
+	if (hotplug_handle < 0) {
+		hotplug_handle = hid_hotplug_register(HE853_VID, HE853_PID, &he853_hotplug, NULL);
+	}
 
-		case 268:
-			return 0xF8;
+	return 0;
+}
 
-		case 486:
-			return 0x01E0;
+/* Send several 8 bytes reports, pipelined on the USB bus */
+static int he853_send_hid_reports(struct he853_instance *inst, uint8_t* buf, int count) {
+	uint8_t obuf[HE853_CONFIG_REPORTS * HE853_HID_REPORT_LEN];
+	int ret = 0;
+	int i, j;
 
-		case 744:
-			return 0x02E3;
+	for (j = 0; j < count; j++) {
+		obuf[j * HE853_HID_REPORT_LEN] = 0x00; // report id = 0, as it seems to be the only report
 
-		case 860:
-			return 0x035A;
+		for (i = 0; i < HE853_REPORT_LEN; i++) {
+			obuf[j * HE853_HID_REPORT_LEN + i + 1] = buf[j * HE853_REPORT_LEN + i];
+		}
 
-		case 900:
-			return 0x0384;
+		if (is_dbg_enabled(2)) {
+			dbg_printf(2, "  %s HID report: ", HARDWARE_NAME);
+			for (i = 0; i < HE853_HID_REPORT_LEN; i++) {
+				dbg_printf(2, "%02X ", obuf[j * HE853_HID_REPORT_LEN + i]);
+			}
+			dbg_printf(2, "\n");
+		}
+	}
 
-		case 1040:
-			return 0x0410;
+	/* Failed transfers are retried with a growing delay */
+	ret = hid_write_batch(inst->handle, obuf, HE853_HID_REPORT_LEN, count, MAX_HID_WRITE_ATTEMPT);
 
-		default:
-			fprintf(stderr, "%s: %d us is not supported as L time !\n", HARDWARE_NAME, usec);
-			return 0;
+	if (ret < 0) {
+		fprintf(stderr, "%s: Cannot send HID reports, hid_write_batch failed (command %d) !\n", HARDWARE_NAME, obuf[1]);
 	}
+
+	return ret;
 }
 
-static int he853_configure(struct timing_config *conf, uint8_t *frame_data, uint8_t bit_count) {
-	uint8_t cmd_buf[32];
+/* Open a lost dongle again, and replay the configuration it had before */
+static int he853_reopen_instance(struct he853_instance *inst, struct hid_device_info *devs) {
+	uint8_t cmd_buf[HE853_CONFIG_REPORTS * HE853_REPORT_LEN];
+	uint8_t valid = inst->report_cache_valid;
+	int count = 0;
+	int i;
+
+	if (he853_open_instance(inst, devs) < 0) {
+		return -1;
+	}
+
+	dbg_printf(1, "%s: Device opened again\n", HARDWARE_NAME);
+
+	inst->report_cache_valid = 0;
+	inst->busy_until = 0;
+
+	for (i = 0; i < HE853_CONFIG_REPORTS; i++) {
+		if (valid & (1 << i)) {
+			memcpy(cmd_buf + count++ * HE853_REPORT_LEN, inst->report_cache[i], HE853_REPORT_LEN);
+		}
+	}
+
+	if (count > 0 && he853_send_hid_reports(inst, cmd_buf, count) >= 0) {
+		inst->report_cache_valid = valid;
+	}
+
+	return 0;
+}
+
+/* Try once to open the lost dongles again, and return the number of usable ones */
+static int he853_reopen_instances(void) {
+	struct hid_device_info *devs = NULL;
+	unsigned int i;
+	int count = 0;
+
+	for (i = 0; i < instance_count; i++) {
+		if (instances[i].handle == NULL) {
+			/* Only needed to find a dongle by serial number */
+			if (devs == NULL && instances[i].path[0] != '\0') {
+				devs = hid_enumerate(HE853_VID, HE853_PID);
+			}
+
+			he853_reopen_instance(&instances[i], devs);
+		}
+
+		if (instances[i].handle != NULL) {
+			count++;
+		}
+	}
+
+	hid_free_enumeration(devs);
+
+	return count;
+}
+
+/* The dongle failed (USB reset, unplugged...), close it until it comes back */
+static void he853_lose_instance(struct he853_instance *inst) {
+	hid_close(inst->handle);
+	inst->handle = NULL;
+
+	fprintf(stderr, "%s: Device lost%s%s\n", HARDWARE_NAME, (inst->path[0] != '\0') ? " " : "", inst->path);
+}
+
+/* Wait for at least one of the lost dongles to come back */
+static int he853_wait_instances(void) {
+	int waited = 0;
+
+	fprintf(stderr, "%s: Waiting for a device to come back...\n", HARDWARE_NAME);
+
+	device_arrived = 0;
+
+	while (he853_reopen_instances() == 0) {
+		if (waited >= REATTACH_TIMEOUT) {
+			fprintf(stderr, "%s: Device did not come back\n", HARDWARE_NAME);
+			return -1;
+		}
+
+		if (hotplug_handle >= 0 && hid_handle_events(REATTACH_POLL_PERIOD) == 0) {
+			/* Returns early when the device arrives */
+			if (device_arrived) {
+				device_arrived = 0;
+				continue;
+			}
+		} else {
+			usleep(REATTACH_POLL_PERIOD * 1000);
+		}
+		waited += REATTACH_POLL_PERIOD;
+	}
+
+	return 0;
+}
+
+static int he853_send_rf_frame(struct he853_instance *inst) {
+	uint8_t cmd_buf[HE853_REPORT_LEN];
+
+	memset(cmd_buf, 0x00, sizeof(cmd_buf));
+	cmd_buf[0] = HE853_CMD_EXECUTE;
+
+	return he853_send_hid_reports(inst, cmd_buf, 1);
+}
+
+/* Build the configuration reports (TIMING1, TIMING2, DATA1 and DATA2) of a frame */
+static int he853_build_config(struct timing_config *conf, uint8_t *frame_data, uint8_t bit_count, uint8_t *cmd_buf) {
 	uint8_t frame_len = (bit_count + 7)/8;
 	uint16_t sbit_htime;
 	uint16_t sbit_ltime;
@@ -240,14 +786,14 @@ static int he853_configure(struct timing_config *conf, uint8_t *frame_data, uint
 	}
 
 	/* Convert from real timings to HE853 timings */
-	sbit_htime = to_he853_htime(conf->start_bit_h_time);
-	sbit_ltime = to_he853_ltime(conf->start_bit_l_time);
-	ebit_htime = to_he853_htime(conf->end_bit_h_time);
-	ebit_ltime = to_he853_ltime(conf->end_bit_l_time);
-	dbit0_htime = to_he853_htime(conf->data_bit0_h_time);
-	dbit0_ltime = to_he853_ltime(conf->data_bit0_l_time);
-	dbit1_htime = to_he853_htime(conf->data_bit1_h_time);
-	dbit1_ltime = to_he853_ltime(conf->data_bit1_l_time);
+	sbit_htime = to_he853_time(&htime_table, conf->start_bit_h_time, UINT16_MAX);
+	sbit_ltime = to_he853_time(&ltime_table, conf->start_bit_l_time, UINT16_MAX);
+	ebit_htime = to_he853_time(&htime_table, conf->end_bit_h_time, UINT16_MAX);
+	ebit_ltime = to_he853_time(&ltime_table, conf->end_bit_l_time, UINT16_MAX);
+	dbit0_htime = to_he853_time(&htime_table, conf->data_bit0_h_time, UINT8_MAX);
+	dbit0_ltime = to_he853_time(&ltime_table, conf->data_bit0_l_time, UINT8_MAX);
+	dbit1_htime = to_he853_time(&htime_table, conf->data_bit1_h_time, UINT8_MAX);
+	dbit1_ltime = to_he853_time(&ltime_table, conf->data_bit1_l_time, UINT8_MAX);
 
 	/* The HE853 dongle needs a positive H time in order to process the L time */
 	if (sbit_ltime != 0 && sbit_htime == 0) {
@@ -299,34 +845,206 @@ static int he853_configure(struct timing_config *conf, uint8_t *frame_data, uint
 		}
 	}
 
-	return he853_send_hid_report(cmd_buf)
-		&& he853_send_hid_report(cmd_buf+8)
-		&& he853_send_hid_report(cmd_buf+16)
-		&& he853_send_hid_report(cmd_buf+24);
+	return 0;
+}
+
+/* Whether a configuration report is already known by the dongle */
+static int he853_is_cached(struct he853_instance *inst, uint8_t *cmd_buf, int idx) {
+	return (inst->report_cache_valid & (1 << idx))
+		&& !memcmp(inst->report_cache[idx], cmd_buf + idx * HE853_REPORT_LEN, HE853_REPORT_LEN);
+}
+
+static int he853_configure(struct he853_instance *inst, uint8_t *cmd_buf) {
+	uint8_t changed_buf[HE853_CONFIG_REPORTS * HE853_REPORT_LEN];
+	int changed[HE853_CONFIG_REPORTS];
+	int changed_count = 0;
+	int i;
+
+	/* Only send the reports that changed, all at once */
+	for (i = 0; i < HE853_CONFIG_REPORTS; i++) {
+		if (he853_is_cached(inst, cmd_buf, i)) {
+			dbg_printf(3, "  %s: Report %d unchanged, skipped\n", HARDWARE_NAME, cmd_buf[i * HE853_REPORT_LEN]);
+			continue;
+		}
+
+		memcpy(changed_buf + changed_count * HE853_REPORT_LEN, cmd_buf + i * HE853_REPORT_LEN, HE853_REPORT_LEN);
+		changed[changed_count++] = i;
+	}
+
+	if (changed_count == 0) {
+		return 0;
+	}
+
+	if (he853_send_hid_reports(inst, changed_buf, changed_count) < 0) {
+		/* Some of them may have been received */
+		for (i = 0; i < changed_count; i++) {
+			inst->report_cache_valid &= ~(1 << changed[i]);
+		}
+		return -1;
+	}
+
+	for (i = 0; i < changed_count; i++) {
+		memcpy(inst->report_cache[changed[i]], changed_buf + i * HE853_REPORT_LEN, HE853_REPORT_LEN);
+		inst->report_cache_valid |= 1 << changed[i];
+	}
+
+	return 0;
+}
+
+/* Time needed to transmit every frame of a command (us) */
+static uint64_t he853_frame_time(struct timing_config *conf, uint8_t *frame_data, uint8_t bit_count) {
+	uint64_t time;
+	int i;
+
+	time = conf->start_bit_h_time + conf->start_bit_l_time + conf->end_bit_h_time + conf->end_bit_l_time;
+	for (i = 0; i < bit_count; i++) {
+		if (frame_data[i/8] & (1 << (7 - (i % 8)))) {
+			time += conf->data_bit1_h_time + conf->data_bit1_l_time;
+		} else {
+			time += conf->data_bit0_h_time + conf->data_bit0_l_time;
+		}
+	}
+
+	return time * conf->frame_count;
+}
+
+/*
+ * The dongles transmit on their own once the frame is sent, so the frame goes
+ * to the least busy one. Among the idle ones, the one already configured with
+ * the most reports of the frame is preferred, then the next one in turn.
+ */
+static struct he853_instance *he853_pick_instance(uint8_t *cmd_buf) {
+	struct he853_instance *inst, *best = NULL;
+	uint64_t now = he853_now();
+	uint64_t busy, best_busy = 0;
+	int cached, best_cached = 0;
+	unsigned int i, j, idx;
+
+	for (i = 1; i <= instance_count; i++) {
+		idx = (last_instance + i) % instance_count;
+		inst = &instances[idx];
+
+		if (inst->handle == NULL) {
+			continue;
+		}
+
+		busy = (inst->busy_until > now) ? (inst->busy_until - now) : 0;
+		for (j = 0, cached = 0; j < HE853_CONFIG_REPORTS; j++) {
+			cached += he853_is_cached(inst, cmd_buf, j);
+		}
+
+		if (best == NULL || busy < best_busy || (busy == best_busy && cached > best_cached)) {
+			best = inst;
+			best_busy = busy;
+			best_cached = cached;
+		}
+	}
+
+	if (best != NULL) {
+		last_instance = best - instances;
+	}
+
+	return best;
 }
 
 static int he853_send_cmd(struct timing_config *config, uint8_t *frame_data, uint16_t bit_count) {
+	uint8_t cmd_buf[HE853_CONFIG_REPORTS * HE853_REPORT_LEN];
+	struct he853_instance *inst;
+	int attempt;
 	int ret = 0;
 
-	if (bit_count > 255) {
+	if (bit_count > HE853_DATA_LEN_MAX * 8) {
 		fprintf(stderr, "%s: Frame is too long !\n", HARDWARE_NAME);
 		return -1;
 	}
 
-	ret = he853_configure(config, frame_data, (uint8_t) bit_count);
-	if (ret < 0) {
-		fprintf(stderr, "%s configuration failed\n", HARDWARE_NAME);
-		return ret;
+	if (instance_count == 0) {
+		fprintf(stderr, "%s: Device not initialized\n", HARDWARE_NAME);
+		return -1;
 	}
 
-	return he853_send_rf_frame();
+	if (he853_build_config(config, frame_data, (uint8_t) bit_count, cmd_buf) < 0) {
+		return -1;
+	}
+
+	/* Lost dongles may be back */
+	if (device_arrived) {
+		device_arrived = 0;
+		he853_reopen_instances();
+	}
+
+	for (attempt = 0; attempt <= MAX_REATTACH_ATTEMPT; attempt++) {
+		inst = he853_pick_instance(cmd_buf);
+
+		/* The command waits for a device to come back, rather than being lost */
+		if (inst == NULL) {
+			if (he853_wait_instances() < 0) {
+				return -1;
+			}
+
+			inst = he853_pick_instance(cmd_buf);
+		}
+
+		ret = he853_configure(inst, cmd_buf);
+		if (ret < 0) {
+			fprintf(stderr, "%s configuration failed\n", HARDWARE_NAME);
+			he853_lose_instance(inst);
+			continue;
+		}
+
+		ret = he853_send_rf_frame(inst);
+		if (ret < 0) {
+			he853_lose_instance(inst);
+			continue;
+		}
+
+		if (instance_count > 1) {
+			dbg_printf(2, "%s: Frame sent to %s\n", HARDWARE_NAME, inst->path);
+		}
+
+		inst->busy_until = he853_now() + he853_frame_time(config, frame_data, (uint8_t) bit_count);
+
+		break;
+	}
+
+	return ret;
 }
 
+/* Time before the least busy dongle is done with its previous frame (us) */
+static uint32_t he853_get_busy_time(void) {
+	uint64_t now = he853_now();
+	uint64_t busy, best_busy = UINT32_MAX;
+	unsigned int i;
+
+	for (i = 0; i < instance_count; i++) {
+		if (instances[i].handle == NULL) {
+			continue;
+		}
+
+		busy = (instances[i].busy_until > now) ? (instances[i].busy_until - now) : 0;
+		if (busy < best_busy) {
+			best_busy = busy;
+		}
+	}
+
+	return (uint32_t) best_busy;
+}
+
+static struct rf_hardware_caps he853_caps = {
+	.max_bit_count = HE853_DATA_LEN_MAX * 8,
+	.time_step = HE853_UNIT_TIME,
+	.setup_time = HE853_SETUP_TIME,
+	.quantize_time = &he853_quantize_time,
+};
+
 struct rf_hardware_driver he853_driver = {
 	.name = HARDWARE_NAME,
 	.cmd_name = "he853",
 	.long_name = "HE853 USB RF dongle",
 	.supported_bit_fmts = (1 << RF_BIT_FMT_HL),
+	.caps = &he853_caps,
+	.get_busy_time = &he853_get_busy_time,
+	.get_probe_path = &he853_get_probe_path,
 	.probe = &he853_probe,
 	.init = &he853_init,
 	.close = &he853_close,
@@ -36,6 +36,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
@@ -68,11 +69,49 @@ Linux/libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
+/* Asynchronous batch writes, see hid_write_batch() */
+#define WRITE_BATCH_DEPTH 4 /* Transfers in flight at the same time */
+#define WRITE_TIMEOUT 1000 /* ms */
+#define WRITE_RETRY_DELAY 10 /* ms, doubled on each new attempt */
+
+struct write_batch;
+
+struct write_slot {
+	struct write_batch *batch;
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	size_t report; /* Index of the report in the batch */
+	int attempts;
+	int busy; /* The transfer is in flight */
+	int retry; /* The report must be sent again at retry_at */
+	struct timeval retry_at;
+};
+
+struct write_batch {
+	hid_device *dev;
+	const unsigned char *data;
+	size_t length;
+	size_t count;
+	size_t next; /* Next report to submit */
+	size_t written;
+	int max_attempts;
+	int in_flight;
+	int failed;
+	int completed; /* Wakes up the event loop */
+	pthread_mutex_t mutex; /* The callbacks may run in read_thread() */
+	struct write_slot slots[WRITE_BATCH_DEPTH];
+};
+
+/* Number of input reports kept until read, the oldest one is dropped past this. */
+#define INPUT_REPORT_SLOTS 32
+
+/* Number of hotplug callbacks registered at the same time. */
+#define HOTPLUG_SLOTS 4
+
+/* Input report received from the device, in a slot of the ring of preallocated reports. */
 struct input_report {
-	uint8_t *data;
+	uint8_t *data; /* input_ep_max_packet_size bytes */
 	size_t len;
-	struct input_report *next;
 };
 
 
@@ -96,22 +135,38 @@ struct hid_device_ {
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 
+	/* Whether input reports are read at all (no read thread otherwise) */
+	int write_only; /* boolean */
+
 	/* Read thread objects */
 	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	pthread_mutex_t mutex; /* Protects the input reports */
 	pthread_cond_t condition;
 	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	int shutdown_thread;
 	struct libusb_transfer *transfer;
 
-	/* List of received input reports. */
-	struct input_report *input_reports;
+	/* Ring of received input reports, allocated before the read thread starts. */
+	struct input_report input_reports[INPUT_REPORT_SLOTS];
+	uint8_t *input_buffer;
+	int input_head; /* Oldest report */
+	int input_count;
+	unsigned long input_overflows; /* Reports dropped because the ring was full */
 };
 
 static int initialized = 0;
 
+/* Registered hotplug callbacks, hid_hotplug_register() returns the slot index. */
+static struct hotplug_slot {
+	int used;
+	libusb_hotplug_callback_handle handle;
+	hid_hotplug_callback callback;
+	void *user_data;
+} hotplug_slots[HOTPLUG_SLOTS];
+
 uint16_t get_usb_code_for_current_locale(void);
 static int return_data(hid_device *dev, unsigned char *data, size_t length);
+static hid_device *open_first_match(unsigned short vendor_id, unsigned short product_id, int flags);
 
 static hid_device *new_hid_device(void)
 {
@@ -125,9 +180,13 @@ static hid_device *new_hid_device(void)
 	dev->product_index = 0;
 	dev->serial_index = 0;
 	dev->blocking = 1;
+	dev->write_only = 0;
 	dev->shutdown_thread = 0;
 	dev->transfer = NULL;
-	dev->input_reports = NULL;
+	dev->input_buffer = NULL;
+	dev->input_head = 0;
+	dev->input_count = 0;
+	dev->input_overflows = 0;
 
 	pthread_mutex_init(&dev->mutex, NULL);
 	pthread_cond_init(&dev->condition, NULL);
@@ -143,6 +202,9 @@ static void free_hid_device(hid_device *dev)
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
+	/* Free the input reports */
+	free(dev->input_buffer);
+
 	/* Free the device itself */
 	free(dev);
 }
@@ -583,11 +645,21 @@ void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 }
 
 hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, wchar_t *serial_number)
+{
+	return hid_open_flags(vendor_id, product_id, serial_number, 0);
+}
+
+hid_device * HID_API_EXPORT hid_open_flags(unsigned short vendor_id, unsigned short product_id, wchar_t *serial_number, int flags)
 {
 	struct hid_device_info *devs, *cur_dev;
 	const char *path_to_open = NULL;
 	hid_device *handle = NULL;
 
+	/* Without a serial number to compare, there is no need to enumerate
+	   (and fetch the strings of) every device */
+	if (!serial_number)
+		return open_first_match(vendor_id, product_id, flags);
+
 	devs = hid_enumerate(vendor_id, product_id);
 	cur_dev = devs;
 	while (cur_dev) {
@@ -609,7 +681,7 @@ hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, wchar
 
 	if (path_to_open) {
 		/* Open the device */
-		handle = hid_open_path(path_to_open);
+		handle = hid_open_path_flags(path_to_open, flags);
 	}
 
 	hid_free_enumeration(devs);
@@ -622,37 +694,27 @@ static void read_callback(struct libusb_transfer *transfer)
 	hid_device *dev = transfer->user_data;
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-
-		struct input_report *rpt = malloc(sizeof(*rpt));
-		rpt->data = malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
+		struct input_report *rpt;
 
 		pthread_mutex_lock(&dev->mutex);
 
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			pthread_cond_signal(&dev->condition);
+		/* Drop the oldest report if the ring is full. This
+		   way we don't block if the user never reads
+		   anything from the device. */
+		if (dev->input_count == INPUT_REPORT_SLOTS) {
+			dev->input_head = (dev->input_head + 1) % INPUT_REPORT_SLOTS;
+			dev->input_count--;
+			dev->input_overflows++;
 		}
-		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
 
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
-			}
+		/* Copy the report in the next free slot. */
+		rpt = &dev->input_reports[(dev->input_head + dev->input_count) % INPUT_REPORT_SLOTS];
+		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
+		rpt->len = transfer->actual_length;
+
+		if (dev->input_count++ == 0) {
+			/* The ring was empty. */
+			pthread_cond_signal(&dev->condition);
 		}
 		pthread_mutex_unlock(&dev->mutex);
 	}
@@ -740,15 +802,160 @@ static void *read_thread(void *param)
 
 
 hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	return hid_open_path_flags(path, 0);
+}
+
+/* Open and claim a HID interface of a USB device, and start reading from it if needed */
+static int open_interface(hid_device *dev, libusb_device *usb_dev,
+                          const struct libusb_device_descriptor *desc,
+                          const struct libusb_interface_descriptor *intf_desc)
+{
+	int res;
+	int i;
+
+	res = libusb_open(usb_dev, &dev->device_handle);
+	if (res < 0) {
+		LOG("can't open device\n");
+		return -1;
+	}
+
+	/* Detach the kernel driver, but only if the
+	   device is managed by the kernel */
+	if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
+		res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
+		if (res < 0) {
+			libusb_close(dev->device_handle);
+			LOG("Unable to detach Kernel Driver\n");
+			return -1;
+		}
+	}
+
+	res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+	if (res < 0) {
+		LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
+		libusb_close(dev->device_handle);
+		return -1;
+	}
+
+	/* Store off the string descriptor indexes, the strings
+	   themselves are only fetched when asked for */
+	dev->manufacturer_index = desc->iManufacturer;
+	dev->product_index      = desc->iProduct;
+	dev->serial_index       = desc->iSerialNumber;
+
+	/* Store off the interface number */
+	dev->interface = intf_desc->bInterfaceNumber;
+
+	/* Find the INPUT and OUTPUT endpoints. An
+	   OUTPUT endpoint is not required. */
+	for (i = 0; i < intf_desc->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep
+			= &intf_desc->endpoint[i];
+
+		/* Determine the type and direction of this
+		   endpoint. */
+		int is_interrupt =
+			(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+		      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
+		int is_output =
+			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+		      == LIBUSB_ENDPOINT_OUT;
+		int is_input =
+			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+		      == LIBUSB_ENDPOINT_IN;
+
+		/* Decide whether to use it for intput or output. */
+		if (dev->input_endpoint == 0 &&
+		    is_interrupt && is_input) {
+			/* Use this endpoint for INPUT */
+			dev->input_endpoint = ep->bEndpointAddress;
+			dev->input_ep_max_packet_size = ep->wMaxPacketSize;
+		}
+		if (dev->output_endpoint == 0 &&
+		    is_interrupt && is_output) {
+			/* Use this endpoint for OUTPUT */
+			dev->output_endpoint = ep->bEndpointAddress;
+		}
+	}
+
+	/* Nothing to read, no need for the read thread */
+	if (!dev->write_only) {
+		/* Input report slots, so that read_callback() never allocates */
+		dev->input_buffer = malloc(INPUT_REPORT_SLOTS * dev->input_ep_max_packet_size);
+		for (i = 0; i < INPUT_REPORT_SLOTS; i++)
+			dev->input_reports[i].data = dev->input_buffer + i * dev->input_ep_max_packet_size;
+
+		pthread_create(&dev->thread, NULL, read_thread, dev);
+
+		// Wait here for the read thread to be initialized.
+		pthread_barrier_wait(&dev->barrier);
+	}
+
+	return 0;
+}
+
+/* Open the first HID interface of the first device matching the VID/PID,
+   looking at the descriptors only (no string descriptor is fetched) */
+static hid_device *open_first_match(unsigned short vendor_id, unsigned short product_id, int flags)
+{
+	hid_device *dev = NULL;
+	libusb_device **devs;
+	libusb_device *usb_dev;
+	int d = 0;
+
+	setlocale(LC_ALL,"");
+
+	if (!initialized)
+		hid_init();
+
+	if (libusb_get_device_list(NULL, &devs) < 0)
+		return NULL;
+
+	while (dev == NULL && (usb_dev = devs[d++]) != NULL) {
+		struct libusb_device_descriptor desc;
+		struct libusb_config_descriptor *conf_desc = NULL;
+		int j,k;
+		libusb_get_device_descriptor(usb_dev, &desc);
+
+		if (desc.idVendor != vendor_id || desc.idProduct != product_id)
+			continue;
+
+		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
+			continue;
+		for (j = 0; j < conf_desc->bNumInterfaces && dev == NULL; j++) {
+			const struct libusb_interface *intf = &conf_desc->interface[j];
+			for (k = 0; k < intf->num_altsetting && dev == NULL; k++) {
+				const struct libusb_interface_descriptor *intf_desc;
+				intf_desc = &intf->altsetting[k];
+				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+					dev = new_hid_device();
+					dev->write_only = (flags & HID_OPEN_WRITE_ONLY) != 0;
+
+					if (open_interface(dev, usb_dev, &desc, intf_desc) < 0) {
+						free_hid_device(dev);
+						dev = NULL;
+					}
+				}
+			}
+		}
+		libusb_free_config_descriptor(conf_desc);
+	}
+
+	libusb_free_device_list(devs, 1);
+
+	return dev;
+}
+
+hid_device * HID_API_EXPORT hid_open_path_flags(const char *path, int flags)
 {
 	hid_device *dev = NULL;
 
 	dev = new_hid_device();
+	dev->write_only = (flags & HID_OPEN_WRITE_ONLY) != 0;
 
 	libusb_device **devs;
 	libusb_device *usb_dev;
-	ssize_t num_devs;
-	int res;
 	int d = 0;
 	int good_open = 0;
 
@@ -757,11 +964,11 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 	if (!initialized)
 		hid_init();
 
-	num_devs = libusb_get_device_list(NULL, &devs);
-	while ((usb_dev = devs[d++]) != NULL) {
+	libusb_get_device_list(NULL, &devs);
+	while (!good_open && (usb_dev = devs[d++]) != NULL) {
 		struct libusb_device_descriptor desc;
 		struct libusb_config_descriptor *conf_desc = NULL;
-		int i,j,k;
+		int j,k;
 		libusb_get_device_descriptor(usb_dev, &desc);
 
 		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
@@ -775,83 +982,9 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 					char *dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber);
 					if (!strcmp(dev_path, path)) {
 						/* Matched Paths. Open this device */
-
-						// OPEN HERE //
-						res = libusb_open(usb_dev, &dev->device_handle);
-						if (res < 0) {
-							LOG("can't open device\n");
-							free(dev_path);
- 							break;
-						}
-						good_open = 1;
-
-						/* Detach the kernel driver, but only if the
-						   device is managed by the kernel */
-						if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
-							res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
-							if (res < 0) {
-								libusb_close(dev->device_handle);
-								LOG("Unable to detach Kernel Driver\n");
-								free(dev_path);
-								good_open = 0;
-								break;
-							}
-						}
-
-						res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
-						if (res < 0) {
-							LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
-							free(dev_path);
-							libusb_close(dev->device_handle);
-							good_open = 0;
-							break;
-						}
-
-						/* Store off the string descriptor indexes */
-						dev->manufacturer_index = desc.iManufacturer;
-						dev->product_index      = desc.iProduct;
-						dev->serial_index       = desc.iSerialNumber;
-
-						/* Store off the interface number */
-						dev->interface = intf_desc->bInterfaceNumber;
-
-						/* Find the INPUT and OUTPUT endpoints. An
-						   OUTPUT endpoint is not required. */
-						for (i = 0; i < intf_desc->bNumEndpoints; i++) {
-							const struct libusb_endpoint_descriptor *ep
-								= &intf_desc->endpoint[i];
-
-							/* Determine the type and direction of this
-							   endpoint. */
-							int is_interrupt =
-								(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
-							      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
-							int is_output =
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_OUT;
-							int is_input =
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_IN;
-
-							/* Decide whether to use it for intput or output. */
-							if (dev->input_endpoint == 0 &&
-							    is_interrupt && is_input) {
-								/* Use this endpoint for INPUT */
-								dev->input_endpoint = ep->bEndpointAddress;
-								dev->input_ep_max_packet_size = ep->wMaxPacketSize;
-							}
-							if (dev->output_endpoint == 0 &&
-							    is_interrupt && is_output) {
-								/* Use this endpoint for OUTPUT */
-								dev->output_endpoint = ep->bEndpointAddress;
-							}
-						}
-
-						pthread_create(&dev->thread, NULL, read_thread, dev);
-
-						// Wait here for the read thread to be initialized.
-						pthread_barrier_wait(&dev->barrier);
-
+						good_open = (open_interface(dev, usb_dev, &desc, intf_desc) == 0);
+						free(dev_path);
+						break;
 					}
 					free(dev_path);
 				}
@@ -925,19 +1058,225 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	}
 }
 
+static void write_batch_callback(struct libusb_transfer *transfer)
+{
+	struct write_slot *slot = transfer->user_data;
+	struct write_batch *batch = slot->batch;
+	int delay;
+
+	pthread_mutex_lock(&batch->mutex);
+
+	slot->busy = 0;
+	batch->in_flight--;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		batch->written++;
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE ||
+	         transfer->status == LIBUSB_TRANSFER_CANCELLED ||
+	         slot->attempts >= batch->max_attempts) {
+		LOG("write of report %zu failed: %d\n", slot->report, transfer->status);
+		batch->failed = 1;
+	}
+	else {
+		/* Send it again later, backing off a bit more each time */
+		delay = WRITE_RETRY_DELAY << (slot->attempts - 1);
+		gettimeofday(&slot->retry_at, NULL);
+		slot->retry_at.tv_sec += delay / 1000;
+		slot->retry_at.tv_usec += (delay % 1000) * 1000;
+		if (slot->retry_at.tv_usec >= 1000000) {
+			slot->retry_at.tv_sec++;
+			slot->retry_at.tv_usec -= 1000000;
+		}
+		slot->retry = 1;
+	}
+
+	batch->completed = 1;
+
+	pthread_mutex_unlock(&batch->mutex);
+}
+
+/* Submit the transfer of a report. Called with batch->mutex locked. */
+static void write_batch_submit(struct write_batch *batch, struct write_slot *slot)
+{
+	hid_device *dev = batch->dev;
+	const unsigned char *data = batch->data + slot->report * batch->length;
+	size_t length = batch->length;
+	int report_number = data[0];
+
+	if (report_number == 0x0) {
+		data++;
+		length--;
+	}
+
+	if (dev->output_endpoint <= 0) {
+		/* No interrput out endpoint. Use the Control Endpoint */
+		libusb_fill_control_setup(slot->buffer,
+			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
+			0x09/*HID Set_Report*/,
+			(2/*HID output*/ << 8) | report_number,
+			dev->interface,
+			length);
+		memcpy(slot->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+		libusb_fill_control_transfer(slot->transfer,
+			dev->device_handle,
+			slot->buffer,
+			write_batch_callback,
+			slot,
+			WRITE_TIMEOUT);
+	}
+	else {
+		/* Use the interrupt out endpoint */
+		memcpy(slot->buffer, data, length);
+		libusb_fill_interrupt_transfer(slot->transfer,
+			dev->device_handle,
+			dev->output_endpoint,
+			slot->buffer,
+			length,
+			write_batch_callback,
+			slot,
+			WRITE_TIMEOUT);
+	}
+
+	slot->attempts++;
+	slot->retry = 0;
+
+	if (libusb_submit_transfer(slot->transfer) < 0) {
+		LOG("can't submit the write of report %zu\n", slot->report);
+		batch->failed = 1;
+		return;
+	}
+
+	slot->busy = 1;
+	batch->in_flight++;
+}
+
+int HID_API_EXPORT hid_write_batch(hid_device *dev, const unsigned char *data, size_t length, size_t count, int max_attempts)
+{
+	struct write_batch *batch;
+	struct write_slot *slot;
+	struct timeval now, tv, *next_retry;
+	int i, res;
+
+	/* On the heap, as the callbacks of transfers which could not be
+	   cancelled would otherwise outlive it */
+	batch = calloc(1, sizeof(*batch));
+	if (batch == NULL)
+		return -1;
+
+	batch->dev = dev;
+	batch->data = data;
+	batch->length = length;
+	batch->count = count;
+	batch->max_attempts = (max_attempts > 0) ? max_attempts : 1;
+	pthread_mutex_init(&batch->mutex, NULL);
+
+	for (i = 0; i < WRITE_BATCH_DEPTH; i++) {
+		slot = &batch->slots[i];
+		slot->batch = batch;
+		slot->transfer = libusb_alloc_transfer(0);
+		slot->buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + length);
+		if (slot->transfer == NULL || slot->buffer == NULL)
+			batch->failed = 1;
+	}
+
+	pthread_mutex_lock(&batch->mutex);
+	while (!batch->failed && batch->written < batch->count) {
+		gettimeofday(&now, NULL);
+		next_retry = NULL;
+
+		/* Fill the free slots, with the reports to send again first */
+		for (i = 0; i < WRITE_BATCH_DEPTH && !batch->failed; i++) {
+			slot = &batch->slots[i];
+			if (slot->busy)
+				continue;
+
+			if (slot->retry) {
+				if (timercmp(&slot->retry_at, &now, <=))
+					write_batch_submit(batch, slot);
+				else if (next_retry == NULL || timercmp(&slot->retry_at, next_retry, <))
+					next_retry = &slot->retry_at;
+			}
+			else if (batch->next < batch->count) {
+				slot->report = batch->next++;
+				slot->attempts = 0;
+				write_batch_submit(batch, slot);
+			}
+		}
+
+		if (batch->failed)
+			break;
+
+		/* Wait for a completion, or for the next retry */
+		tv.tv_sec = WRITE_TIMEOUT / 1000;
+		tv.tv_usec = (WRITE_TIMEOUT % 1000) * 1000;
+		if (next_retry != NULL) {
+			timersub(next_retry, &now, &tv);
+		}
+
+		batch->completed = 0;
+		pthread_mutex_unlock(&batch->mutex);
+		res = libusb_handle_events_timeout_completed(NULL, &tv, &batch->completed);
+		pthread_mutex_lock(&batch->mutex);
+
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
+			batch->failed = 1;
+		}
+	}
+
+	/* On failure, cancel what is still in flight and wait for it */
+	for (i = 0; i < WRITE_BATCH_DEPTH; i++) {
+		if (batch->slots[i].busy)
+			libusb_cancel_transfer(batch->slots[i].transfer);
+	}
+
+	while (batch->in_flight > 0) {
+		tv.tv_sec = WRITE_TIMEOUT / 1000;
+		tv.tv_usec = (WRITE_TIMEOUT % 1000) * 1000;
+		batch->completed = 0;
+		pthread_mutex_unlock(&batch->mutex);
+		res = libusb_handle_events_timeout_completed(NULL, &tv, &batch->completed);
+		pthread_mutex_lock(&batch->mutex);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED)
+			break;
+	}
+
+	for (i = 0; i < WRITE_BATCH_DEPTH; i++) {
+		/* A transfer still in flight can not be freed */
+		if (batch->slots[i].busy)
+			continue;
+		libusb_free_transfer(batch->slots[i].transfer);
+		free(batch->slots[i].buffer);
+	}
+
+	res = batch->failed ? -1 : (int) batch->written;
+
+	if (batch->in_flight > 0) {
+		/* Its callbacks may still run later (e.g. from the read
+		   thread), so the batch is deliberately leaked */
+		LOG("%d write(s) could not be cancelled\n", batch->in_flight);
+		pthread_mutex_unlock(&batch->mutex);
+		return -1;
+	}
+	pthread_mutex_unlock(&batch->mutex);
+	pthread_mutex_destroy(&batch->mutex);
+	free(batch);
+
+	return res;
+}
+
 /* Helper function, to simplify hid_read().
    This should be called with dev->mutex locked. */
 static int return_data(hid_device *dev, unsigned char *data, size_t length)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
+	/* Copy the data out of the oldest report (rpt) into the
+	   return buffer (data), and free its slot. */
+	struct input_report *rpt = &dev->input_reports[dev->input_head];
 	size_t len = (length < rpt->len)? length: rpt->len;
 	if (len > 0)
 		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
+	dev->input_head = (dev->input_head + 1) % INPUT_REPORT_SLOTS;
+	dev->input_count--;
 	return len;
 }
 
@@ -952,6 +1291,9 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 {
 	int bytes_read = -1;
 
+	if (dev->write_only)
+		return -1;
+
 #if 0
 	int transferred;
 	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
@@ -963,7 +1305,7 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	pthread_cleanup_push(&cleanup_mutex, dev);
 
 	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
+	if (dev->input_count) {
 		/* Return the first one */
 		bytes_read = return_data(dev, data, length);
 		goto ret;
@@ -978,10 +1320,10 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 
 	if (milliseconds == -1) {
 		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!dev->input_count && !dev->shutdown_thread) {
 			pthread_cond_wait(&dev->condition, &dev->mutex);
 		}
-		if (dev->input_reports) {
+		if (dev->input_count) {
 			bytes_read = return_data(dev, data, length);
 		}
 	}
@@ -997,10 +1339,10 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 			ts.tv_nsec -= 1000000000L;
 		}
 
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!dev->input_count && !dev->shutdown_thread) {
 			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
 			if (res == 0) {
-				if (dev->input_reports) {
+				if (dev->input_count) {
 					bytes_read = return_data(dev, data, length);
 					break;
 				}
@@ -1038,6 +1380,17 @@ int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
 	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
 }
 
+unsigned long HID_API_EXPORT hid_get_input_overflows(hid_device *dev)
+{
+	unsigned long overflows;
+
+	pthread_mutex_lock(&dev->mutex);
+	overflows = dev->input_overflows;
+	pthread_mutex_unlock(&dev->mutex);
+
+	return overflows;
+}
+
 int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 {
 	dev->blocking = !nonblock;
@@ -1112,16 +1465,18 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
-	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	if (!dev->write_only) {
+		/* Cause read_thread() to stop. */
+		dev->shutdown_thread = 1;
+		libusb_cancel_transfer(dev->transfer);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+		/* Wait for read_thread() to end. */
+		pthread_join(dev->thread, NULL);
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+		/* Clean up the Transfer objects allocated in read_thread(). */
+		free(dev->transfer->buffer);
+		libusb_free_transfer(dev->transfer);
+	}
 
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1129,13 +1484,6 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
-
 	free_hid_device(dev);
 }
 
@@ -1171,12 +1519,106 @@ int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index
 }
 
 
+int HID_API_EXPORT_CALL hid_get_usb_location(hid_device *dev, unsigned char *bus, unsigned char *address)
+{
+	libusb_device *usb_dev;
+
+	if (dev == NULL || dev->device_handle == NULL)
+		return -1;
+
+	usb_dev = libusb_get_device(dev->device_handle);
+	*bus = libusb_get_bus_number(usb_dev);
+	*address = libusb_get_device_address(usb_dev);
+
+	return 0;
+}
+
+
 HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
 {
 	return NULL;
 }
 
 
+static int hotplug_callback(libusb_context *ctx, libusb_device *usb_dev, libusb_hotplug_event event, void *user_data)
+{
+	struct hotplug_slot *slot = user_data;
+	struct libusb_device_descriptor desc;
+
+	(void) ctx;
+
+	if (libusb_get_device_descriptor(usb_dev, &desc) < 0)
+		return 0;
+
+	slot->callback(desc.idVendor, desc.idProduct,
+		(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) ? HID_HOTPLUG_ARRIVED : HID_HOTPLUG_LEFT,
+		slot->user_data);
+
+	/* Stay registered */
+	return 0;
+}
+
+int HID_API_EXPORT hid_hotplug_register(unsigned short vendor_id, unsigned short product_id, hid_hotplug_callback callback, void *user_data)
+{
+	int i;
+
+	if (!initialized && hid_init() < 0)
+		return -1;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		LOG("hotplug events not supported\n");
+		return -1;
+	}
+
+	for (i = 0; i < HOTPLUG_SLOTS; i++) {
+		if (!hotplug_slots[i].used)
+			break;
+	}
+	if (i == HOTPLUG_SLOTS)
+		return -1;
+
+	hotplug_slots[i].callback = callback;
+	hotplug_slots[i].user_data = user_data;
+
+	if (libusb_hotplug_register_callback(NULL,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_NO_FLAGS, vendor_id, product_id, LIBUSB_HOTPLUG_MATCH_ANY,
+		hotplug_callback, &hotplug_slots[i], &hotplug_slots[i].handle) != LIBUSB_SUCCESS) {
+		LOG("can't register the hotplug callback\n");
+		return -1;
+	}
+
+	hotplug_slots[i].used = 1;
+
+	return i;
+}
+
+void HID_API_EXPORT hid_hotplug_deregister(int handle)
+{
+	if (handle < 0 || handle >= HOTPLUG_SLOTS || !hotplug_slots[handle].used)
+		return;
+
+	libusb_hotplug_deregister_callback(NULL, hotplug_slots[handle].handle);
+	hotplug_slots[handle].used = 0;
+}
+
+int HID_API_EXPORT hid_handle_events(int milliseconds)
+{
+	struct timeval tv;
+
+	if (!initialized && hid_init() < 0)
+		return -1;
+
+	tv.tv_sec = milliseconds / 1000;
+	tv.tv_usec = (milliseconds % 1000) * 1000;
+
+	if (libusb_handle_events_timeout_completed(NULL, &tv, NULL) < 0)
+		return -1;
+
+	return 0;
+}
+
+
 struct lang_map_entry {
 	const char *name;
 	const char *string_code;
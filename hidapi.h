@@ -45,6 +45,16 @@ extern "C" {
 		struct hid_device_;
 		typedef struct hid_device_ hid_device; /**< opaque hidapi structure */
 
+		/** Flags for hid_open_flags() and hid_open_path_flags() */
+		#define HID_OPEN_WRITE_ONLY 0x1 /**< No input report is ever read from the device */
+
+		/** Events passed to a #hid_hotplug_callback */
+		#define HID_HOTPLUG_ARRIVED 0x1 /**< A matching device was plugged in */
+		#define HID_HOTPLUG_LEFT    0x2 /**< A matching device was unplugged */
+
+		/** Function called on a hotplug event, see hid_hotplug_register() */
+		typedef void (HID_API_CALL *hid_hotplug_callback)(unsigned short vendor_id, unsigned short product_id, int event, void *user_data);
+
 		/** hidapi info structure */
 		struct hid_device_info {
 			/** Platform-specific device path */
@@ -172,6 +182,41 @@ extern "C" {
 		*/
 		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path);
 
+		/** @brief Open a HID device using a Vendor ID (VID), Product ID
+			(PID) and optionally a serial number, with open flags.
+
+			Same as hid_open(), with @p flags. With HID_OPEN_WRITE_ONLY,
+			no input report is read from the device: hid_read() and
+			hid_read_timeout() always fail, but opening the device does
+			not start the read thread and its INTERRUPT IN transfer.
+
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the device to open.
+			@param product_id The Product ID (PID) of the device to open.
+			@param serial_number The Serial Number of the device to open
+				               (Optionally NULL).
+			@param flags A combination of HID_OPEN_* flags.
+
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_open_flags(unsigned short vendor_id, unsigned short product_id, wchar_t *serial_number, int flags);
+
+		/** @brief Open a HID device by its path name, with open flags.
+
+			Same as hid_open_path(), with @p flags (see hid_open_flags()).
+
+			@ingroup API
+		    @param path The path name of the device to open
+			@param flags A combination of HID_OPEN_* flags.
+
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path_flags(const char *path, int flags);
+
 		/** @brief Write an Output report to a HID device.
 
 			The first byte of @p data[] must contain the Report ID. For
@@ -200,6 +245,31 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_write(hid_device *device, const unsigned char *data, size_t length);
 
+		/** @brief Write several Output reports to a HID device, asynchronously.
+
+			The reports are laid out one after the other in @p data[],
+			each one being @p length bytes long and formatted as for
+			hid_write(). Several transfers are kept in flight at the
+			same time, and a report whose transfer fails is sent again
+			after a delay which grows with each attempt. The reports
+			are submitted in order, but a report sent again may reach
+			the device after the ones that follow it.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data The reports to send, including the report
+				number as the first byte of each one.
+			@param length The length in bytes of each report.
+			@param count The number of reports to send.
+			@param max_attempts The number of times a report is tried
+				before giving up.
+
+			@returns
+				This function returns the number of reports written and
+				-1 on error.
+		*/
+		int  HID_API_EXPORT HID_API_CALL hid_write_batch(hid_device *device, const unsigned char *data, size_t length, size_t count, int max_attempts);
+
 		/** @brief Read an Input report from a HID device with timeout.
 
 			Input reports are returned
@@ -239,6 +309,20 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_read(hid_device *device, unsigned char *data, size_t length);
 
+		/** @brief Get the number of Input reports dropped so far.
+
+			Received Input reports are kept in a fixed number of slots
+			until they are read. When all the slots are used, the oldest
+			report is dropped to make room for the new one.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+
+			@returns
+				This function returns the number of dropped reports.
+		*/
+		unsigned long HID_API_EXPORT HID_API_CALL hid_get_input_overflows(hid_device *device);
+
 		/** @brief Set the device handle to be non-blocking.
 
 			In non-blocking mode calls to hid_read() will return
@@ -364,6 +448,21 @@ extern "C" {
 		*/
 		int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *device, int string_index, wchar_t *string, size_t maxlen);
 
+		/** @brief Get the USB bus number and device address of a device.
+
+			The address changes whenever the device is plugged in again,
+			so that it tells whether this is still the same device.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param bus The bus number.
+			@param address The device address on the bus.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_get_usb_location(hid_device *device, unsigned char *bus, unsigned char *address);
+
 		/** @brief Get a string describing the last error which occurred.
 
 			@ingroup API
@@ -375,6 +474,44 @@ extern "C" {
 		*/
 		HID_API_EXPORT const wchar_t* HID_API_CALL hid_error(hid_device *device);
 
+		/** @brief Be notified when a device is plugged in or unplugged.
+
+			The callback is called with HID_HOTPLUG_ARRIVED or
+			HID_HOTPLUG_LEFT from the thread handling the USB events:
+			the read thread of an opened device, or any thread calling
+			hid_handle_events() or writing to a device. It must not
+			open or close devices itself.
+
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the devices to watch.
+			@param product_id The Product ID (PID) of the devices to watch.
+			@param callback The function to call.
+			@param user_data Passed to @p callback.
+
+			@returns
+				This function returns a handle for
+				hid_hotplug_deregister() on success, and -1 on error or
+				if hotplug events are not supported on this platform.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_hotplug_register(unsigned short vendor_id, unsigned short product_id, hid_hotplug_callback callback, void *user_data);
+
+		/** @brief Stop the hotplug notifications.
+
+			@ingroup API
+			@param handle A handle returned from hid_hotplug_register().
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_hotplug_deregister(int handle);
+
+		/** @brief Handle the pending USB events, such as hotplug events.
+
+			@ingroup API
+			@param milliseconds The time to wait for an event.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_handle_events(int milliseconds);
+
 #ifdef __cplusplus
 }
 #endif
@@ -24,54 +24,342 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/vfs.h>
 
 #include "rf-ctrl.h"
 
 #define HARDWARE_NAME			"OOK GPIO"
 
-#define OOK_GPIO_TIMINGS_PATH		"/sys/devices/platform/ook-gpio.0/timings"
-#define OOK_GPIO_FRAME_PATH		"/sys/devices/platform/ook-gpio.0/frame"
+#define OOK_GPIO_SYSFS_ROOT		"/sys/devices/platform"
+#define OOK_GPIO_INSTANCE_PREFIX	"ook-gpio."
+#define OOK_GPIO_TIMINGS		"timings"		// At instance level
+#define OOK_GPIO_FRAME			"frame"			// At instance level
 
+#define SYSFS_MAGIC			0x62656572
 
-static int ook_gpio_probe(void) {
-	if (access(OOK_GPIO_TIMINGS_PATH, W_OK ) < 0) {
-		dbg_printf(3, "%s: no access to %s\n", HARDWARE_NAME, OOK_GPIO_TIMINGS_PATH);
-		dbg_printf(2, "%s not detected\n", HARDWARE_NAME);
+#define OOK_GPIO_INSTANCE_MAX		8
+#define OOK_GPIO_PATH_MAX		256
+#define OOK_GPIO_ATTR_PATH_MAX		(OOK_GPIO_PATH_MAX + sizeof("/"OOK_GPIO_TIMINGS))	// Longest attribute name
+
+#define OOK_GPIO_BUSY_RETRY_DELAY	1000			// us
+#define OOK_GPIO_BUSY_TIMEOUT		30000000		// us
+
+#define OOK_GPIO_TIME_STEP		1			// us, timed by the kernel
+#define OOK_GPIO_SETUP_TIME		100			// us, sysfs writes
+
+/* 10 timing values of up to 5 digits, 9 ',' and '\0' */
+#define OOK_GPIO_TIMINGS_STR_MAX	(10 * 5 + 9 + 1)
+
+/* Bit count (up to 5 digits), then up to 8192 bytes of up to 3 digits, each preceded by ',', and '\0' */
+#define OOK_GPIO_FRAME_STR_MAX		(5 + 4 * ((UINT16_MAX + 7)/8) + 1)
+
+struct ook_gpio_instance {
+	char path[OOK_GPIO_PATH_MAX];
+	int timings_fd;
+	int frame_fd;
+
+	/* Regular files standing in for the sysfs attributes (e.g. for testing) */
+	uint8_t is_fake;
+
+	/* Last timings string written to this instance */
+	char last_timings[OOK_GPIO_TIMINGS_STR_MAX];
+};
+
+static struct ook_gpio_instance instances[OOK_GPIO_INSTANCE_MAX];
+static unsigned int instance_count = 0;
+
+/* Instance that received the last frame */
+static unsigned int last_instance = 0;
+
+static char frame_str[OOK_GPIO_FRAME_STR_MAX];
+
+
+static int ook_gpio_check_instance(const char *path) {
+	char attr_path[OOK_GPIO_ATTR_PATH_MAX];
+
+	snprintf(attr_path, sizeof(attr_path), "%s/%s", path, OOK_GPIO_TIMINGS);
+	if (access(attr_path, W_OK ) < 0) {
+		dbg_printf(3, "%s: no access to %s\n", HARDWARE_NAME, attr_path);
+		return -1;
+	}
+
+	snprintf(attr_path, sizeof(attr_path), "%s/%s", path, OOK_GPIO_FRAME);
+	if (access(attr_path, W_OK ) < 0) {
+		dbg_printf(3, "%s: no access to %s\n", HARDWARE_NAME, attr_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int ook_gpio_add_instance(const char *path) {
+	struct ook_gpio_instance *inst;
+
+	if (instance_count >= OOK_GPIO_INSTANCE_MAX) {
+		fprintf(stderr, "%s: Too many instances, ignoring %s\n", HARDWARE_NAME, path);
 		return -1;
 	}
 
-	if (access(OOK_GPIO_FRAME_PATH, W_OK ) < 0) {
-		dbg_printf(3, "%s: no access to %s\n", HARDWARE_NAME, OOK_GPIO_FRAME_PATH);
+	inst = &instances[instance_count];
+
+	snprintf(inst->path, OOK_GPIO_PATH_MAX, "%s", path);
+	inst->timings_fd = -1;
+	inst->frame_fd = -1;
+	inst->last_timings[0] = '\0';
+
+	instance_count++;
+
+	return 0;
+}
+
+static int ook_gpio_compare_paths(const void *a, const void *b) {
+	const struct ook_gpio_instance *inst_a = a;
+	const struct ook_gpio_instance *inst_b = b;
+	size_t len_a = strlen(inst_a->path);
+	size_t len_b = strlen(inst_b->path);
+
+	/* Shorter first, so that ook-gpio.2 comes before ook-gpio.10 */
+	if (len_a != len_b) {
+		return (len_a < len_b) ? -1 : 1;
+	}
+
+	return strcmp(inst_a->path, inst_b->path);
+}
+
+/* Look for all the ook-gpio.<n> instances usable in the sysfs platform folder */
+static int ook_gpio_discover_instances(void) {
+	DIR *dir;
+	struct dirent *entry;
+	char path[OOK_GPIO_PATH_MAX];
+
+	dir = opendir(OOK_GPIO_SYSFS_ROOT);
+	if (dir == NULL) {
+		dbg_printf(3, "%s: no access to %s\n", HARDWARE_NAME, OOK_GPIO_SYSFS_ROOT);
+		return -1;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, OOK_GPIO_INSTANCE_PREFIX, sizeof(OOK_GPIO_INSTANCE_PREFIX) - 1)) {
+			continue;
+		}
+
+		if (snprintf(path, OOK_GPIO_PATH_MAX, "%s/%s", OOK_GPIO_SYSFS_ROOT, entry->d_name) >= OOK_GPIO_PATH_MAX) {
+			continue;
+		}
+
+		if (ook_gpio_check_instance(path) < 0) {
+			continue;
+		}
+
+		if (ook_gpio_add_instance(path) < 0) {
+			break;
+		}
+	}
+
+	closedir(dir);
+
+	qsort(instances, instance_count, sizeof(instances[0]), &ook_gpio_compare_paths);
+
+	return (instance_count > 0) ? 0 : -1;
+}
+
+/*
+ * Parse a comma-separated list of instances. Each of them can be a full
+ * path to an instance folder (e.g. a fake sysfs tree), an instance name
+ * (ook-gpio.1) or an instance number (1). "all" selects every instance found.
+ */
+static int ook_gpio_select_instances(const char *device) {
+	char *list, *name, *saveptr;
+	char path[OOK_GPIO_PATH_MAX];
+	int len, ret = 0;
+
+	if (!strcmp(device, "all")) {
+		return ook_gpio_discover_instances();
+	}
+
+	list = strdup(device);
+	if (list == NULL) {
+		return -1;
+	}
+
+	for (name = strtok_r(list, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+		while (*name == ' ' || *name == '\t') {
+			name++;
+		}
+
+		if (strchr(name, '/') != NULL) {
+			len = snprintf(path, OOK_GPIO_PATH_MAX, "%s", name);
+		} else if (!strncmp(name, OOK_GPIO_INSTANCE_PREFIX, sizeof(OOK_GPIO_INSTANCE_PREFIX) - 1)) {
+			len = snprintf(path, OOK_GPIO_PATH_MAX, "%s/%s", OOK_GPIO_SYSFS_ROOT, name);
+		} else {
+			len = snprintf(path, OOK_GPIO_PATH_MAX, "%s/%s%s", OOK_GPIO_SYSFS_ROOT, OOK_GPIO_INSTANCE_PREFIX, name);
+		}
+
+		if (len >= OOK_GPIO_PATH_MAX) {
+			fprintf(stderr, "%s: Instance path too long (%s)\n", HARDWARE_NAME, name);
+			ret = -1;
+			break;
+		}
+
+		if (ook_gpio_add_instance(path) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	free(list);
+
+	return ret;
+}
+
+static int ook_gpio_probe(void) {
+	instance_count = 0;
+
+	if (ook_gpio_discover_instances() < 0) {
 		dbg_printf(2, "%s not detected\n", HARDWARE_NAME);
 		return -1;
 	}
 
-	dbg_printf(1, "%s detected\n", HARDWARE_NAME);
+	dbg_printf(1, "%s detected (%s)\n", HARDWARE_NAME, instances[0].path);
 
 	return 0;
 }
 
-static int ook_gpio_init(struct rf_hardware_params *params) {
+static int ook_gpio_get_probe_path(char *path, size_t len) {
+	if (instance_count == 0) {
+		return -1;
+	}
+
+	snprintf(path, len, "%s", instances[0].path);
+
 	return 0;
 }
 
 static void ook_gpio_close(void) {
+	unsigned int i;
+
+	for (i = 0; i < instance_count; i++) {
+		if (instances[i].timings_fd >= 0) {
+			close(instances[i].timings_fd);
+		}
+
+		if (instances[i].frame_fd >= 0) {
+			close(instances[i].frame_fd);
+		}
+	}
+
+	instance_count = 0;
+}
+
+static int ook_gpio_open_instance(struct ook_gpio_instance *inst) {
+	char path[OOK_GPIO_ATTR_PATH_MAX];
+	struct statfs fs;
+
+	snprintf(path, sizeof(path), "%s/%s", inst->path, OOK_GPIO_TIMINGS);
+
+	inst->timings_fd = open(path, O_WRONLY);
+	if (inst->timings_fd < 0) {
+		fprintf(stderr, "%s: Cannot open timings path \"%s\" (%s)\n", HARDWARE_NAME, path, strerror(errno));
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", inst->path, OOK_GPIO_FRAME);
+
+	inst->frame_fd = open(path, O_WRONLY);
+	if (inst->frame_fd < 0) {
+		fprintf(stderr, "%s: Cannot open frame path \"%s\" (%s)\n", HARDWARE_NAME, path, strerror(errno));
+		return -1;
+	}
+
+	inst->last_timings[0] = '\0';
+	inst->is_fake = (fstatfs(inst->frame_fd, &fs) == 0 && fs.f_type != SYSFS_MAGIC);
+
+	if (inst->is_fake) {
+		dbg_printf(2, "%s: %s is not a sysfs folder\n", HARDWARE_NAME, inst->path);
+	}
+
+	return 0;
 }
 
-static int ook_gpio_set_timings(struct timing_config *conf) {
-	FILE *f_timings;
+static int ook_gpio_init(struct rf_hardware_params *params) {
+	unsigned int i;
 	int ret;
 
-	f_timings = fopen(OOK_GPIO_TIMINGS_PATH, "w");
-	if (!f_timings) {
-		fprintf(stderr, "%s: Cannot open timings path \"%s\"\n", HARDWARE_NAME, OOK_GPIO_TIMINGS_PATH);
+	instance_count = 0;
+
+	if (params->provided_params & PARAM_HW_DEVICE) {
+		ret = ook_gpio_select_instances(params->device);
+	} else {
+		/* Only use the first instance found by default */
+		ret = ook_gpio_discover_instances();
+		if (ret == 0) {
+			instance_count = 1;
+		}
+	}
+
+	if (ret < 0 || instance_count == 0) {
+		fprintf(stderr, "%s: No usable instance\n", HARDWARE_NAME);
+		ook_gpio_close();
 		return -1;
 	}
 
+	for (i = 0; i < instance_count; i++) {
+		printf("%s: Using %s\n", HARDWARE_NAME, instances[i].path);
+
+		if (ook_gpio_open_instance(&instances[i]) < 0) {
+			ook_gpio_close();
+			return -1;
+		}
+	}
+
+	last_instance = instance_count - 1;
+
+	return 0;
+}
+
+/* Write an unsigned value in decimal, and return the number of characters written */
+static size_t ook_gpio_write_uint(char *str, unsigned int val) {
+	char tmp[10];
+	size_t len = 0;
+	size_t i;
+
+	do {
+		tmp[len++] = '0' + (val % 10);
+		val /= 10;
+	} while (val > 0);
+
+	for (i = 0; i < len; i++) {
+		str[i] = tmp[len - 1 - i];
+	}
+
+	return len;
+}
+
+/* Sysfs attributes are written in one go at offset 0, the file does not need to be reopened */
+static int ook_gpio_write_attr(struct ook_gpio_instance *inst, int fd, char *str, size_t len) {
+	ssize_t ret;
+
+	ret = pwrite(fd, str, len, 0);
+	if (ret < 0) {
+		return -errno;
+	}
+
+	/* Regular files would otherwise keep the tail of a longer previous content */
+	if (inst->is_fake && ftruncate(fd, ret) < 0) {
+		return -errno;
+	}
+
+	return ((size_t) ret == len) ? 0 : -EIO;
+}
+
+static int ook_gpio_format_timings(char *str, size_t str_size, struct timing_config *conf) {
 	switch (conf->bit_fmt) {
 		case RF_BIT_FMT_HL:
 		case RF_BIT_FMT_LH:
-			ret = fprintf(f_timings, "%u,%u,%u,%u,%u,%u,%u,%u,%u,%u",
+			snprintf(str, str_size, "%u,%u,%u,%u,%u,%u,%u,%u,%u,%u",
 					conf->start_bit_h_time, conf->start_bit_l_time,
 					conf->end_bit_h_time, conf->end_bit_l_time,
 					conf->data_bit0_h_time, conf->data_bit0_l_time,
@@ -80,79 +368,131 @@ static int ook_gpio_set_timings(struct timing_config *conf) {
 			break;
 
 		case RF_BIT_FMT_RAW:
-			ret = fprintf(f_timings, "%u,0,0,0,0,0,0,0,2,%u",
+			snprintf(str, str_size, "%u,0,0,0,0,0,0,0,2,%u",
 					conf->base_time, conf->frame_count);
 			break;
 
 		default:
 			fprintf(stderr, "%s: Bit format %s is not supported !\n", HARDWARE_NAME, rf_bit_fmt_str[(int) conf->bit_fmt]);
-			fclose(f_timings);
 			return -1;
 	}
 
+	return 0;
+}
+
+static int ook_gpio_set_timings(struct ook_gpio_instance *inst, char *timings) {
+	int ret;
+
+	/* The kernel module keeps the timings, no need to write them again if they did not change */
+	if (!strcmp(timings, inst->last_timings)) {
+		dbg_printf(3, "%s: Timings unchanged for %s, skipping\n", HARDWARE_NAME, inst->path);
+		return 0;
+	}
+
+	ret = ook_gpio_write_attr(inst, inst->timings_fd, timings, strlen(timings));
 	if (ret < 0) {
-		fprintf(stderr, "%s: Cannot write timings\n", HARDWARE_NAME);
+		inst->last_timings[0] = '\0';
+		return ret;
 	}
 
-	fclose(f_timings);
+	strcpy(inst->last_timings, timings);
 
-	return (ret < 0) ? ret : 0;
+	return 0;
 }
 
-static int ook_gpio_send_frame(uint8_t *frame_data, uint16_t bit_count) {
-	FILE *f_frame;
-	uint32_t str_size;
-	char *str;
+/* "<bit count>,<byte 0>,<byte 1>,..." built in a single pass */
+static size_t ook_gpio_format_frame(char *str, uint8_t *frame_data, uint16_t bit_count) {
 	unsigned int byte_count = (bit_count + 7)/8;
-	int ret;
+	size_t len;
 	int i;
 
-	f_frame = fopen(OOK_GPIO_FRAME_PATH, "w");
-	if (!f_frame) {
-		fprintf(stderr, "%s: Cannot open frame path \"%s\"\n", HARDWARE_NAME, OOK_GPIO_FRAME_PATH);
-		return -1;
-	}
-
-	/* Size of the string: 1 byte + n bytes + n ',' + '\0' = 4 * (n + 1) */
-	str_size = 4 * (byte_count + 1);
-	str = (char*) malloc(str_size * sizeof(char));
-
-	sprintf(str, "%u", bit_count);
+	len = ook_gpio_write_uint(str, bit_count);
 	for (i = 0; i < byte_count; i++) {
-		sprintf(str, "%s,%u", str, frame_data[i]);
+		str[len++] = ',';
+		len += ook_gpio_write_uint(str + len, frame_data[i]);
 	}
+	str[len] = '\0';
 
-	ret = fprintf(f_frame, "%s", str);
-	if (ret < 0) {
-		fprintf(stderr, "%s: Cannot write frame\n", HARDWARE_NAME);
-	}
-
-	free(str);
-	fclose(f_frame);
-
-	return (ret < 0) ? ret : 0;
+	return len;
 }
 
+/*
+ * The kernel module transmits asynchronously, so frames are dispatched in
+ * a round-robin way, an instance still busy with the previous frame being
+ * skipped in favor of the next one.
+ */
 static int ook_gpio_send_cmd(struct timing_config *config, uint8_t *frame_data, uint16_t bit_count) {
+	char timings[OOK_GPIO_TIMINGS_STR_MAX];
+	struct ook_gpio_instance *inst;
+	size_t len;
+	unsigned int i, idx;
+	unsigned long waited = 0;
 	int ret = 0;
 
-	ret = ook_gpio_set_timings(config);
-	if (ret < 0) {
+	if (instance_count == 0) {
+		fprintf(stderr, "%s: Device not initialized\n", HARDWARE_NAME);
+		return -1;
+	}
+
+	if (ook_gpio_format_timings(timings, sizeof(timings), config) < 0) {
 		fprintf(stderr, "%s timings configuration failed\n", HARDWARE_NAME);
-		return ret;
+		return -1;
 	}
 
-	return ook_gpio_send_frame(frame_data, bit_count);
+	len = ook_gpio_format_frame(frame_str, frame_data, bit_count);
+
+	for (;;) {
+		for (i = 1; i <= instance_count; i++) {
+			idx = (last_instance + i) % instance_count;
+			inst = &instances[idx];
+
+			ret = ook_gpio_set_timings(inst, timings);
+			if (ret == -EBUSY) {
+				continue;
+			} else if (ret < 0) {
+				fprintf(stderr, "%s: Cannot write timings to %s (%s)\n", HARDWARE_NAME, inst->path, strerror(-ret));
+				return ret;
+			}
+
+			ret = ook_gpio_write_attr(inst, inst->frame_fd, frame_str, len);
+			if (ret == -EBUSY) {
+				continue;
+			} else if (ret < 0) {
+				fprintf(stderr, "%s: Cannot write frame to %s (%s)\n", HARDWARE_NAME, inst->path, strerror(-ret));
+				return ret;
+			}
+
+			dbg_printf(2, "%s: Frame sent to %s\n", HARDWARE_NAME, inst->path);
+			last_instance = idx;
+
+			return 0;
+		}
+
+		/* Every instance is busy */
+		if (waited >= OOK_GPIO_BUSY_TIMEOUT) {
+			fprintf(stderr, "%s: All instances busy, giving up\n", HARDWARE_NAME);
+			return -EBUSY;
+		}
+
+		usleep(OOK_GPIO_BUSY_RETRY_DELAY);
+		waited += OOK_GPIO_BUSY_RETRY_DELAY;
+	}
 }
 
+static struct rf_hardware_caps ook_gpio_caps = {
+	.time_step = OOK_GPIO_TIME_STEP,
+	.setup_time = OOK_GPIO_SETUP_TIME,
+};
+
 struct rf_hardware_driver ook_gpio_driver = {
 	.name = HARDWARE_NAME,
 	.cmd_name = "ook-gpio",
 	.long_name = "OOK GPIO-based 433 MHz RF Transmitter",
 	.supported_bit_fmts = (1 << RF_BIT_FMT_HL) | (1 << RF_BIT_FMT_LH) | (1 << RF_BIT_FMT_RAW),
+	.caps = &ook_gpio_caps,
+	.get_probe_path = &ook_gpio_get_probe_path,
 	.probe = &ook_gpio_probe,
 	.init = &ook_gpio_init,
 	.close = &ook_gpio_close,
 	.send_cmd = &ook_gpio_send_cmd,
 };
-
@@ -0,0 +1,99 @@
+/*
+ * rf-ctrl - A command-line tool to control 433MHz OOK based devices
+ * Hardware drivers built as plugins, loaded on demand
+ *
+ * Copyright (C) 2018 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include "rf-ctrl.h"
+#include "plugin.h"
+
+#ifndef PLUGIN_PATH
+#define PLUGIN_PATH			"/usr/local/lib/rf-ctrl"
+#endif
+
+#define PLUGIN_PATH_MAX			512
+#define PLUGIN_SYMBOL_MAX		64
+
+/*
+ * Drivers pulling in extra libraries (libusb, libasound, ...) are only known
+ * by their names until their plugin is loaded, which fills in the rest
+ */
+struct rf_hardware_driver he853_driver = {
+	.name = "HE853",
+	.cmd_name = "he853",
+	.long_name = "HE853 USB RF dongle",
+};
+
+#ifdef ALSA_ENABLED
+struct rf_hardware_driver alsa_driver = {
+	.name = "Alsa",
+	.cmd_name = "alsa",
+	.long_name = "Alsa 433MHz Differential RF Transceiver",
+};
+#endif
+
+/*
+ * Load the plugin of a driver (<cmd_name>.so from the plugin folder, exporting
+ * <cmd_name>_driver), if not built in and not loaded yet
+ */
+int plugin_load_hw_driver(struct rf_hardware_driver *driver) {
+	char path[PLUGIN_PATH_MAX];
+	char symbol[PLUGIN_SYMBOL_MAX];
+	struct rf_hardware_driver *plugin;
+	void *handle;
+	char *p;
+
+	if (driver->init != NULL) {
+		return 0;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s.so", PLUGIN_PATH, driver->cmd_name);
+
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		dbg_printf(2, "Cannot load the %s plugin (%s)\n", driver->name, dlerror());
+		return -1;
+	}
+
+	snprintf(symbol, sizeof(symbol), "%s_driver", driver->cmd_name);
+	for (p = symbol; *p != '\0'; p++) {
+		if (*p == '-') {
+			*p = '_';
+		}
+	}
+
+	plugin = (struct rf_hardware_driver *) dlsym(handle, symbol);
+	if (plugin == NULL || plugin->init == NULL) {
+		dbg_printf(2, "No %s driver in %s\n", driver->name, path);
+		dlclose(handle);
+		return -1;
+	}
+
+	dbg_printf(2, "%s driver loaded from %s\n", plugin->name, path);
+
+	/* The plugin stays loaded until exit */
+	*driver = *plugin;
+
+	return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * rf-ctrl - A command-line tool to control 433MHz OOK based devices
+ * Hardware probe results kept across invocations
+ *
+ * Copyright (C) 2018 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "rf-ctrl.h"
+#include "probe-cache.h"
+
+/* Used when XDG_RUNTIME_DIR is not set (e.g. when run by root) */
+#ifndef PROBE_CACHE_LOCATION
+#define PROBE_CACHE_LOCATION		"/run"
+#endif
+
+#define PROBE_CACHE_FILE		"rf-ctrl.probe"
+#define PROBE_CACHE_PATH_MAX		512
+#define PROBE_CACHE_LINE_MAX		1024
+#define PROBE_CACHE_FIELD_MAX		64
+
+#define PROBE_CACHE_FIELD_TOPOLOGY	"TOPOLOGY"
+
+#define PROBE_CACHE_USB_ROOT		"/dev/bus/usb"
+#define PROBE_CACHE_PLATFORM_ROOT	"/sys/devices/platform"
+
+#define FNV_OFFSET_BASIS		2166136261u
+#define FNV_PRIME			16777619u
+
+
+static void probe_cache_get_path(char *path, size_t len) {
+	char *dir = getenv("XDG_RUNTIME_DIR");
+
+	snprintf(path, len, "%s/%s", (dir != NULL && *dir != '\0') ? dir : PROBE_CACHE_LOCATION, PROBE_CACHE_FILE);
+}
+
+static uint32_t fnv_hash(uint32_t hash, const void *data, size_t len) {
+	const uint8_t *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ p[i]) * FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/*
+ * Signature of the platform devices present (e.g. the ook-gpio instances).
+ * Sysfs does not update the modification time of the folders, so their
+ * names are used instead.
+ */
+static uint32_t probe_cache_platform(void) {
+	struct dirent *entry;
+	uint32_t signature = 0;
+	DIR *dir;
+
+	dir = opendir(PROBE_CACHE_PLATFORM_ROOT);
+	if (dir == NULL) {
+		return 0;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		/* Summed, so that the order of the folders does not matter */
+		signature += fnv_hash(FNV_OFFSET_BASIS, entry->d_name, strlen(entry->d_name));
+	}
+
+	closedir(dir);
+
+	return signature;
+}
+
+/*
+ * Signature of the USB and platform devices present. The USB nodes are created and
+ * removed in the bus folders, which updates the modification time of these folders.
+ */
+static uint32_t probe_cache_topology(void) {
+	char path[PROBE_CACHE_PATH_MAX];
+	struct dirent *entry;
+	struct stat st;
+	uint32_t hash, signature;
+	DIR *dir;
+
+	signature = probe_cache_platform();
+
+	dir = opendir(PROBE_CACHE_USB_ROOT);
+	if (dir == NULL) {
+		return signature;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", PROBE_CACHE_USB_ROOT, entry->d_name);
+		if (stat(path, &st) < 0) {
+			continue;
+		}
+
+		hash = fnv_hash(FNV_OFFSET_BASIS, entry->d_name, strlen(entry->d_name));
+		hash = fnv_hash(hash, &st.st_mtim, sizeof(st.st_mtim));
+
+		/* Summed, so that the order of the folders does not matter */
+		signature += hash;
+	}
+
+	closedir(dir);
+
+	return signature;
+}
+
+/*
+ * Get the drivers detected by a previous run, as long as the USB and platform devices did
+ * not change and the device found by each driver is still there
+ */
+uint32_t probe_cache_load(struct rf_hardware_driver **drivers, size_t count) {
+	char path[PROBE_CACHE_PATH_MAX];
+	char line[PROBE_CACHE_LINE_MAX];
+	char field[PROBE_CACHE_FIELD_MAX];
+	char value[PROBE_CACHE_PATH_MAX];
+	uint32_t hw_mask = 0, topology = 0;
+	int has_topology = 0;
+	struct stat st;
+	size_t i;
+	FILE *f;
+
+	probe_cache_get_path(path, sizeof(path));
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#' || sscanf(line, "%63s = %511s", field, value) != 2) {
+			continue;
+		}
+
+		if (!strcmp(field, PROBE_CACHE_FIELD_TOPOLOGY)) {
+			topology = strtoul(value, NULL, 16);
+			has_topology = 1;
+			continue;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (!strcmp(drivers[i]->cmd_name, field)) {
+				break;
+			}
+		}
+
+		if (i == count || stat(value, &st) < 0) {
+			dbg_printf(2, "Probe cache: %s (%s) is gone\n", field, value);
+			goto invalid;
+		}
+
+		hw_mask |= 1 << i;
+	}
+
+	if (!has_topology || topology != probe_cache_topology()) {
+		dbg_printf(2, "Probe cache: USB or platform devices changed\n");
+		goto invalid;
+	}
+
+	fclose(f);
+
+	if (hw_mask != 0) {
+		dbg_printf(2, "Using the hardware detected previously (%s)\n", path);
+	}
+
+	return hw_mask;
+
+invalid:
+	fclose(f);
+	unlink(path);
+
+	return 0;
+}
+
+/* Keep the drivers just detected, if every one of them can tell how to check its device is still there */
+void probe_cache_save(struct rf_hardware_driver **drivers, size_t count, uint32_t hw_mask) {
+	char path[PROBE_CACHE_PATH_MAX];
+	char tmp_path[PROBE_CACHE_PATH_MAX + 16];
+	char value[PROBE_CACHE_PATH_MAX];
+	size_t i;
+	FILE *f;
+
+	probe_cache_get_path(path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int) getpid());
+
+	f = fopen(tmp_path, "w");
+	if (f == NULL) {
+		dbg_printf(2, "Probe cache: cannot write %s\n", tmp_path);
+		return;
+	}
+
+	fprintf(f, "# Hardware detected by rf-ctrl, valid as long as the USB and platform devices and the paths below do not change\n");
+	fprintf(f, "%s = %08x\n", PROBE_CACHE_FIELD_TOPOLOGY, probe_cache_topology());
+
+	for (i = 0; i < count; i++) {
+		if (!(hw_mask & (1 << i))) {
+			continue;
+		}
+
+		if (drivers[i]->get_probe_path == NULL || drivers[i]->get_probe_path(value, sizeof(value)) < 0) {
+			fclose(f);
+			unlink(tmp_path);
+			return;
+		}
+
+		fprintf(f, "%s = %s\n", drivers[i]->cmd_name, value);
+	}
+
+	/* Replaced at once, so that other runs never read a partial file */
+	if (fclose(f) != 0 || rename(tmp_path, path) < 0) {
+		dbg_printf(2, "Probe cache: cannot write %s\n", path);
+		unlink(tmp_path);
+	}
+}
+
+/* Forget the drivers detected, so that the next run probes them again */
+void probe_cache_invalidate(void) {
+	char path[PROBE_CACHE_PATH_MAX];
+
+	probe_cache_get_path(path, sizeof(path));
+
+	if (unlink(path) == 0) {
+		dbg_printf(2, "Probe cache: %s removed\n", path);
+	}
+}
@@ -0,0 +1,29 @@
+/*
+ * rf-ctrl - A command-line tool to control 433MHz OOK based devices
+ * Hardware probe results kept across invocations
+ *
+ * Copyright (C) 2018 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _PROBE_CACHE_H_
+#define _PROBE_CACHE_H_
+
+uint32_t probe_cache_load(struct rf_hardware_driver **drivers, size_t count);
+void probe_cache_save(struct rf_hardware_driver **drivers, size_t count, uint32_t hw_mask);
+void probe_cache_invalidate(void);
+
+#endif /* _PROBE_CACHE_H_ */
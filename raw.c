@@ -80,6 +80,72 @@ size_t raw_write_bits(uint8_t *buf, size_t offset, uint8_t *data, size_t data_bi
 	return (count - offset);
 }
 
+/* Get length (1 to 8) bits starting at offset, as the most significant bits of a byte */
+static uint8_t raw_get_bits(uint8_t *src, size_t offset, uint8_t length) {
+	uint8_t shift = offset % 8;
+	uint8_t byte = src[offset/8] << shift;
+
+	if (shift + length > 8) {
+		byte |= src[offset/8 + 1] >> (8 - shift);
+	}
+
+	return byte;
+}
+
+/* Copy bits from src to buf, a byte at most at a time */
+size_t raw_copy_bits(uint8_t *buf, size_t offset, uint8_t *src, size_t src_offset, size_t length) {
+	size_t done = 0;
+	uint8_t shift, count, mask;
+
+	while (done < length) {
+		/* Up to the end of the destination byte */
+		shift = (offset + done) % 8;
+		count = 8 - shift;
+		if (count > length - done) {
+			count = length - done;
+		}
+
+		mask = (uint8_t) (0xFF << (8 - count)) >> shift;
+		buf[(offset + done)/8] = (buf[(offset + done)/8] & ~mask) | ((raw_get_bits(src, src_offset + done, count) >> shift) & mask);
+
+		done += count;
+	}
+
+	return length;
+}
+
+int raw_template_add_field(struct raw_template *tpl, size_t offset, size_t length, size_t src_offset) {
+	if (tpl->field_count >= RAW_TEMPLATE_FIELDS_MAX) {
+		fprintf(stderr, "Too many fields in the RAW template (%u max)\n", RAW_TEMPLATE_FIELDS_MAX);
+		return -1;
+	}
+
+	tpl->fields[tpl->field_count].offset = offset;
+	tpl->fields[tpl->field_count].length = length;
+	tpl->fields[tpl->field_count].src_offset = src_offset;
+	tpl->field_count++;
+
+	return 0;
+}
+
+/* Copy the template to buf, then splice the fields rendered in src into it */
+int raw_template_apply(struct raw_template *tpl, uint8_t *buf, size_t buf_len, uint8_t *src) {
+	uint8_t i;
+
+	if (tpl->bit_count > (buf_len * 8)) {
+		fprintf(stderr, "RAW buffer too small (%lu bits) for this template (%lu bits)\n", (unsigned long) (buf_len * 8), (unsigned long) tpl->bit_count);
+		return -1;
+	}
+
+	memcpy(buf, tpl->data, (tpl->bit_count + 7)/8);
+
+	for (i = 0; i < tpl->field_count; i++) {
+		raw_copy_bits(buf, tpl->fields[i].offset, src, tpl->fields[i].src_offset, tpl->fields[i].length);
+	}
+
+	return tpl->bit_count;
+}
+
 int raw_generate_hl_frame(uint8_t *dest_frame_data, size_t dest_data_len, struct timing_config *config, uint8_t *src_frame_data, uint16_t src_bit_count, uint16_t base_time) {
 	uint16_t i;
 	size_t count = 0;
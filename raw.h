@@ -27,10 +27,32 @@ typedef enum {
 	RAW_EDGE_ORDER_LH =		1,
 } raw_edge_order_t;
 
+#define RAW_TEMPLATE_FIELDS_MAX		16
+
+/*
+ * Pre-rendered RAW frame, of which only some bit ranges change from one command to
+ * another: each range is filled with the bits of a field rendered separately
+ */
+struct raw_template_field {
+	size_t offset;
+	size_t length;
+	size_t src_offset;
+};
+
+struct raw_template {
+	uint8_t *data;
+	size_t bit_count;
+	struct raw_template_field fields[RAW_TEMPLATE_FIELDS_MAX];
+	uint8_t field_count;
+};
+
 size_t raw_write_low(uint8_t *buf, size_t offset, uint8_t length);
 size_t raw_write_high(uint8_t *buf, size_t offset, uint8_t length);
 size_t raw_write_edge(uint8_t *buf, size_t offset, raw_edge_order_t order, uint8_t h_len, uint8_t l_len);
 size_t raw_write_bits(uint8_t *buf, size_t offset, uint8_t *data, size_t data_bit_len, raw_edge_order_t zero_order, uint8_t zero_h_len, uint8_t zero_l_len, raw_edge_order_t one_order, uint8_t one_h_len, uint8_t one_l_len);
+size_t raw_copy_bits(uint8_t *buf, size_t offset, uint8_t *src, size_t src_offset, size_t length);
+int raw_template_add_field(struct raw_template *tpl, size_t offset, size_t length, size_t src_offset);
+int raw_template_apply(struct raw_template *tpl, uint8_t *buf, size_t buf_len, uint8_t *src);
 int raw_generate_hl_frame(uint8_t *dest_frame_data, size_t dest_data_len, struct timing_config *config, uint8_t *src_frame_data, uint16_t src_bit_count, uint16_t base_time);
 
 #endif /* _RAW_H_ */
@@ -25,13 +25,16 @@
 #include <string.h>
 #include <ctype.h>
 #include <getopt.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <pwd.h>
 #include <unistd.h>
 
 #include "rf-ctrl.h"
 #include "raw.h"
+#include "frame.h"
+#include "probe-cache.h"
+#include "code-store.h"
+#ifdef PLUGINS_ENABLED
+#include "plugin.h"
+#endif
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -40,12 +43,12 @@
 #define COPYRIGHT_DATE			"2018"
 #define AUTHOR_NAME			"Jean-Christophe Rona"
 
-#define STORAGE_PATH_BASE		"."APP_NAME
-
 #define MAX_FRAME_LENGTH		512
 
 #define DEFAULT_RAW_FALLBACK_ACCURACY	90 // This changes how accurate will be the base_time for generated RAW frames (100 minus the allowed error in % of the shortest timing)
 
+#define HW_TIMING_ERROR_MAX		5 // %, hardware drivers off by more than this are only used when no other one does better
+
 #ifndef CONFIG_FILE_LOCATION
 #define CONFIG_FILE_LOCATION		"/etc"
 #endif
@@ -54,9 +57,18 @@
 #define CONFIG_LINE_MAX			1024 // bytes
 
 #define CONFIG_FIELD_HARDWARE		"HARDWARE"
+#define CONFIG_FIELD_HW_DEVICE		"HW_DEVICE"
 #define CONFIG_FIELD_GPIO		"GPIO"
+#define CONFIG_FIELD_GPIO_KEEP		"GPIO_KEEP_EXPORTED"
 #define CONFIG_FIELD_RAW		"FORCE_RAW"
 #define CONFIG_FIELD_ACCURACY		"RAW_ACCURACY"
+#define CONFIG_FIELD_ALSA_CONTINUOUS	"ALSA_CONTINUOUS"
+#define CONFIG_FIELD_ALSA_RATE		"ALSA_RATE"
+#define CONFIG_FIELD_ALSA_CHANNELS	"ALSA_CHANNELS"
+#define CONFIG_FIELD_ALSA_FORMAT	"ALSA_FORMAT"
+#define CONFIG_FIELD_ALSA_DUAL_CHANNEL	"ALSA_DUAL_CHANNEL"
+#define CONFIG_FIELD_HE853_CALIBRATION	"HE853_CALIBRATION"
+#define CONFIG_FIELD_CODE_STORE_SYNC	"CODE_STORE_SYNC"
 
 #define CONFIG_VALUE_TRUE		"TRUE"
 #define CONFIG_VALUE_FALSE		"FALSE"
@@ -74,6 +86,8 @@ char *(parameter_str[]) = {
 	"raw",
 	"gpio",
 	"verbose",
+	"keep-gpio",
+	"hw-device",
 };
 
 /* WARNING: Needs to remain in-sync with rf_command_t enum in rf-ctrl.h */
@@ -106,8 +120,6 @@ char *(rf_bit_fmt_str[]) = {
 	"Raw",
 };
 
-static struct rf_hardware_driver *current_hw_driver = NULL;
-
 static int debug_level = 0;
 
 static uint8_t raw_fallback_accuracy = DEFAULT_RAW_FALLBACK_ACCURACY;
@@ -128,6 +140,7 @@ extern struct rf_hardware_driver sysfs_gpio_driver;
 #ifdef ALSA_ENABLED
 extern struct rf_hardware_driver alsa_driver;
 #endif
+extern struct rf_hardware_driver wav_driver;
 extern struct rf_hardware_driver dummy_driver;
 
 struct rf_protocol_driver *(protocol_drivers[]) = {
@@ -149,9 +162,53 @@ struct rf_hardware_driver *(hardware_drivers[]) = {
 #ifdef ALSA_ENABLED
 	&alsa_driver,
 #endif
+	&wav_driver,
 	&dummy_driver,
 };
 
+/* Initialized hardware drivers, in the order of hardware_drivers[] */
+static struct rf_hardware_driver *(active_hw_drivers[ARRAY_SIZE(hardware_drivers)]);
+static unsigned int active_hw_count = 0;
+
+/* Hardware devices, per driver, the last slot holding the one given without a driver name */
+#define HW_DEVICE_ANY			ARRAY_SIZE(hardware_drivers)
+static char *(hw_devices[ARRAY_SIZE(hardware_drivers) + 1]);
+
+/* How a frame is handed to a hardware driver */
+typedef enum {
+	HW_ROUTE_NATIVE =	0,
+	HW_ROUTE_HL =		1, // LH frame rewritten as HL
+	HW_ROUTE_RAW =		2,
+	HW_ROUTE_UNROLLED =	3, // preamble, repetitions and trailer of a RAW frame as a single one
+	HW_ROUTE_MAX,
+	HW_ROUTE_NONE =		HW_ROUTE_MAX,
+} hw_route_t;
+
+/* WARNING: Needs to remain in-sync with hw_route_t enum */
+static char *(hw_route_str[]) = {
+	"native",
+	"rewritten as HL",
+	"converted to RAW",
+	"unrolled",
+};
+
+/* A frame, as it can be handed to the hardware drivers */
+struct frame_variant {
+	struct timing_config timings;
+	uint8_t data[MAX_FRAME_LENGTH];
+	int bit_count; // FRAME_NOT_BUILT until needed, negative if it cannot be built
+};
+
+#define FRAME_NOT_BUILT			-2
+
+/* What sending a frame through a hardware driver would be like */
+struct hw_choice {
+	struct rf_hardware_driver *driver;
+	hw_route_t route;
+	uint32_t error; // per mille, worst timing error
+	uint64_t delay; // us, before the frame starts being transmitted
+};
+
 int is_dbg_enabled(int level) {
 	return (level <= debug_level);
 }
@@ -170,41 +227,6 @@ void dbg_printf(int level, char *buff, ...) {
 	va_end(arglist);
 }
 
-static void mkdir_p(const char *dir) {
-	char *tmp, *p = NULL;
-	size_t len;
-
-	tmp = strdup(dir);
-	len = strlen(tmp);
-
-	if (tmp[len - 1] == '/') {
-		tmp[len - 1] = 0;
-	}
-
-	for (p = tmp + 1; *p != '\0'; p++) {
-		if (*p == '/') {
-			*p = 0;
-			mkdir(tmp, S_IRWXU);
-			*p = '/';
-		}
-	}
-	mkdir(tmp, S_IRWXU);
-
-	free(tmp);
-}
-
-void get_storage_path(char *path, struct rf_protocol_driver *protocol) {
-	struct stat st = {0};
-	struct passwd *pw = getpwuid(getuid());
-
-	snprintf(path, STORAGE_PATH_MAX_LEN, "%s/%s/%s", pw->pw_dir, STORAGE_PATH_BASE, protocol->cmd_name);
-
-	/* Create the folder if it does not exist */
-	if (stat(path, &st) < 0) {
-		mkdir_p(path);
-	}
-}
-
 static struct rf_protocol_driver * get_protocol_driver_by_id(unsigned int protocol) {
 	if (protocol >= ARRAY_SIZE(protocol_drivers)) {
 		return NULL;
@@ -237,14 +259,6 @@ static int get_protocol_id_by_name(char *protocol_str) {
 	return -1;
 }
 
-static struct rf_hardware_driver * get_hw_driver_by_id(unsigned int hw) {
-	if (hw >= ARRAY_SIZE(hardware_drivers)) {
-		return NULL;
-	}
-
-	return hardware_drivers[hw];
-}
-
 static struct rf_hardware_driver * get_hw_driver_by_name(char *hw_str) {
 	int i;
 
@@ -257,16 +271,28 @@ static struct rf_hardware_driver * get_hw_driver_by_name(char *hw_str) {
 	return NULL;
 }
 
-static struct rf_hardware_driver * auto_detect_hw_driver(void) {
+/* Drivers built as plugins only get their functions once loaded */
+static int load_hw_driver(struct rf_hardware_driver *driver) {
+#ifdef PLUGINS_ENABLED
+	return plugin_load_hw_driver(driver);
+#else
+	(void) driver;
+	return 0;
+#endif
+}
+
+/* Every driver detected is used, the best one being picked for each frame */
+static uint32_t auto_detect_hw_drivers(void) {
+	uint32_t hw_mask = 0;
 	int i;
 
 	for (i = 0; i < ARRAY_SIZE(hardware_drivers); i++) {
-		if (!hardware_drivers[i]->probe()) {
-			return hardware_drivers[i];
+		if (!load_hw_driver(hardware_drivers[i]) && !hardware_drivers[i]->probe()) {
+			hw_mask |= 1 << i;
 		}
 	}
 
-	return NULL;
+	return hw_mask;
 }
 
 static int get_hw_id_by_name(char *hw_str) {
@@ -281,6 +307,72 @@ static int get_hw_id_by_name(char *hw_str) {
 	return -1;
 }
 
+/* Parse a comma-separated list of hardware drivers, by name or index */
+static int parse_hw_list(char *hw_str, uint32_t *hw_mask) {
+	char *list, *item, *saveptr, *p;
+	uint32_t mask = 0;
+	int hw;
+
+	list = strdup(hw_str);
+	if (list == NULL) {
+		return -1;
+	}
+
+	for (item = strtok_r(list, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+		hw = strtoul(item, &p, 0);
+		if (*p != '\0') {
+			hw = get_hw_id_by_name(item);
+		}
+
+		if (hw < 0 || hw >= ARRAY_SIZE(hardware_drivers)) {
+			free(list);
+			return -1;
+		}
+
+		mask |= 1 << hw;
+	}
+
+	free(list);
+
+	if (mask == 0) {
+		return -1;
+	}
+
+	*hw_mask = mask;
+
+	return 0;
+}
+
+/*
+ * Set a hardware device, only for the named driver if given as "<driver>:<device>",
+ * otherwise for every driver without a device of its own
+ */
+static void set_hw_device(char *value) {
+	char *sep;
+	int hw = HW_DEVICE_ANY;
+
+	/* Device names may contain ':' too (e.g. hw:1,0), so only a driver name is a prefix */
+	sep = strchr(value, ':');
+	if (sep != NULL) {
+		*sep = '\0';
+		hw = get_hw_id_by_name(value);
+		*sep = ':';
+
+		if (hw < 0) {
+			hw = HW_DEVICE_ANY;
+		} else {
+			value = sep + 1;
+		}
+	}
+
+	free(hw_devices[hw]);
+	hw_devices[hw] = strdup(value);
+}
+
+static char *get_hw_device(int hw) {
+	return (hw_devices[hw] != NULL) ? hw_devices[hw] : hw_devices[HW_DEVICE_ANY];
+}
+
 static int get_cmd_id_by_name(char *cmd_str) {
 	int i;
 
@@ -293,7 +385,7 @@ static int get_cmd_id_by_name(char *cmd_str) {
 	return -1;
 }
 
-static int parse_config_file(uint16_t *provided_params, int *hw, struct rf_hardware_params *hw_params) {
+static int parse_config_file(uint16_t *provided_params, uint32_t *hw_mask, struct rf_hardware_params *hw_params) {
 	FILE * f;
 	char line[CONFIG_LINE_MAX];
 	char *field, *value;
@@ -343,17 +435,19 @@ static int parse_config_file(uint16_t *provided_params, int *hw, struct rf_hardw
 		}
 
 		if (!strncmp(field, CONFIG_FIELD_HARDWARE, sizeof(CONFIG_FIELD_HARDWARE) - 1)) {
-			*hw = strtoul(value, &p, 0);
-			if (*p != '\0') {
-				*hw = get_hw_id_by_name(value);
-			}
-
-			if (*hw < 0 || *hw >= ARRAY_SIZE(hardware_drivers)) {
+			if (parse_hw_list(value, hw_mask) < 0) {
 				fprintf(stderr, "Unsupported RF hardware %s in configuration file\n", value);
 				continue;
 			}
 
 			*provided_params |= PARAM_HARDWARE;
+		} else if (!strncmp(field, CONFIG_FIELD_HW_DEVICE, sizeof(CONFIG_FIELD_HW_DEVICE) - 1)) {
+			set_hw_device(value);
+			*provided_params |= PARAM_HW_DEVICE;
+		} else if (!strncmp(field, CONFIG_FIELD_GPIO_KEEP, sizeof(CONFIG_FIELD_GPIO_KEEP) - 1)) {
+			if (!strncmp(value, CONFIG_VALUE_TRUE, sizeof(CONFIG_VALUE_TRUE) - 1)) {
+				*provided_params |= PARAM_GPIO_KEEP;
+			}
 		} else if (!strncmp(field, CONFIG_FIELD_GPIO, sizeof(CONFIG_FIELD_GPIO) - 1)) {
 			hw_params->gpio = strtoul(value, &p, 0);
 			*provided_params |= PARAM_GPIO;
@@ -369,6 +463,22 @@ static int parse_config_file(uint16_t *provided_params, int *hw, struct rf_hardw
 			}
 
 			*provided_params |= PARAM_ACCURACY;
+		} else if (!strncmp(field, CONFIG_FIELD_ALSA_CONTINUOUS, sizeof(CONFIG_FIELD_ALSA_CONTINUOUS) - 1)) {
+			hw_params->alsa_continuous = !strncmp(value, CONFIG_VALUE_TRUE, sizeof(CONFIG_VALUE_TRUE) - 1);
+		} else if (!strncmp(field, CONFIG_FIELD_ALSA_RATE, sizeof(CONFIG_FIELD_ALSA_RATE) - 1)) {
+			hw_params->alsa_rate = strtoul(value, NULL, 0);
+		} else if (!strncmp(field, CONFIG_FIELD_ALSA_CHANNELS, sizeof(CONFIG_FIELD_ALSA_CHANNELS) - 1)) {
+			hw_params->alsa_channels = strtoul(value, NULL, 0);
+		} else if (!strncmp(field, CONFIG_FIELD_ALSA_FORMAT, sizeof(CONFIG_FIELD_ALSA_FORMAT) - 1)) {
+			free(hw_params->alsa_format);
+			hw_params->alsa_format = strdup(value);
+		} else if (!strncmp(field, CONFIG_FIELD_ALSA_DUAL_CHANNEL, sizeof(CONFIG_FIELD_ALSA_DUAL_CHANNEL) - 1)) {
+			hw_params->alsa_dual_channel = !strncmp(value, CONFIG_VALUE_TRUE, sizeof(CONFIG_VALUE_TRUE) - 1);
+		} else if (!strncmp(field, CONFIG_FIELD_HE853_CALIBRATION, sizeof(CONFIG_FIELD_HE853_CALIBRATION) - 1)) {
+			free(hw_params->he853_calibration);
+			hw_params->he853_calibration = strdup(value);
+		} else if (!strncmp(field, CONFIG_FIELD_CODE_STORE_SYNC, sizeof(CONFIG_FIELD_CODE_STORE_SYNC) - 1)) {
+			code_store_set_sync(strtoul(value, NULL, 0));
 		}
 	}
 
@@ -434,25 +544,314 @@ static uint16_t find_best_base_time(struct timing_config *config) {
 	return (uint16_t) gcd(gcd1, gcd3, accuracy);
 }
 
+/* Round a time (us) to the resolution of a hardware driver */
+static uint32_t quantize_time(uint32_t time, uint16_t step) {
+	if (step <= 1) {
+		return time;
+	}
+
+	return ((time + step/2)/step) * step;
+}
+
+/* Time (us) actually sent by a hardware driver for a pulse */
+static uint32_t hw_quantize_time(struct rf_hardware_caps *caps, uint32_t time, uint8_t high) {
+	if (caps->quantize_time != NULL) {
+		return caps->quantize_time(time, high);
+	}
+
+	return quantize_time(time, caps->time_step);
+}
+
+/* Relative error (per mille) of a time once transmitted */
+static uint32_t time_error(uint32_t time, uint32_t achieved) {
+	if (time == 0) {
+		return 0;
+	}
+
+	return (uint32_t) (((uint64_t) ((achieved > time) ? (achieved - time) : (time - achieved)) * 1000)/time);
+}
+
+/* Worst timing error (per mille) of a frame sent with the given timings by a driver of the given capabilities */
+static uint32_t get_timing_error(struct timing_config *config, struct timing_config *sent, struct rf_hardware_caps *caps) {
+	uint16_t times[8] = {
+		config->start_bit_h_time, config->start_bit_l_time,
+		config->end_bit_h_time, config->end_bit_l_time,
+		config->data_bit0_h_time, config->data_bit0_l_time,
+		config->data_bit1_h_time, config->data_bit1_l_time,
+	};
+	uint32_t error, worst = 0;
+	int i;
+
+	if (config->bit_fmt == RF_BIT_FMT_RAW) {
+		return time_error(config->base_time, hw_quantize_time(caps, config->base_time, 1));
+	}
+
+	for (i = 0; i < ARRAY_SIZE(times); i++) {
+		if (sent->bit_fmt == RF_BIT_FMT_RAW) {
+			/* Each time is made of whole RAW bits, as done in raw_generate_hl_frame() */
+			error = time_error(times[i], (times[i]/sent->base_time) * hw_quantize_time(caps, sent->base_time, 1));
+		} else {
+			/* The H and L times alternate in times[] */
+			error = time_error(times[i], hw_quantize_time(caps, times[i], !(i & 1)));
+		}
+
+		if (error > worst) {
+			worst = error;
+		}
+	}
+
+	/* The HL rewrite merges the pulses, so the merged times have to be checked as well */
+	if (sent != config && sent->bit_fmt != RF_BIT_FMT_RAW) {
+		error = get_timing_error(sent, sent, caps);
+		if (error > worst) {
+			worst = error;
+		}
+	}
+
+	return worst;
+}
+
+/* Build a variant of the frame (HL rewrite or RAW conversion), if not done yet */
+static int build_frame_variant(struct frame_variant *frames, hw_route_t route, struct timing_config *config) {
+	struct frame_variant *native = &frames[HW_ROUTE_NATIVE];
+	struct frame_variant *frame = &frames[route];
+	uint16_t base_time;
+
+	if (frame->bit_count != FRAME_NOT_BUILT) {
+		return frame->bit_count;
+	}
+
+	frame->bit_count = -1;
+
+	switch (route) {
+		case HW_ROUTE_HL:
+			frame->bit_count = frame_lh_to_hl(&frame->timings, frame->data, sizeof(frame->data), config, native->data, (uint16_t) native->bit_count);
+			break;
+
+		case HW_ROUTE_RAW:
+			base_time = find_best_base_time(config);
+
+			memset(frame->data, 0, sizeof(frame->data));
+			frame->bit_count = raw_generate_hl_frame(frame->data, sizeof(frame->data), config, native->data, (uint16_t) native->bit_count, base_time);
+
+			memset(&frame->timings, 0, sizeof(frame->timings));
+			frame->timings.base_time = base_time;
+			frame->timings.bit_fmt = RF_BIT_FMT_RAW;
+			frame->timings.frame_count = config->frame_count;
+			break;
+
+		case HW_ROUTE_UNROLLED:
+			memset(frame->data, 0, sizeof(frame->data));
+			frame->bit_count = frame_unroll(&frame->timings, frame->data, sizeof(frame->data), config, native->data, (uint16_t) native->bit_count);
+			break;
+
+		default:
+			break;
+	}
+
+	return frame->bit_count;
+}
+
+/* How a frame would be handed to a hardware driver, and which variant could not be built if none */
+static hw_route_t get_hw_route(struct rf_hardware_driver *driver, struct frame_variant *frames, struct timing_config *config, uint8_t force_raw, hw_route_t *failed) {
+	uint8_t fmts = driver->supported_bit_fmts;
+
+	*failed = HW_ROUTE_NONE;
+
+	if (config->bit_fmt == RF_BIT_FMT_LH && !(force_raw && (fmts & (1 << RF_BIT_FMT_RAW)))
+			&& !(fmts & (1 << RF_BIT_FMT_LH)) && (fmts & (1 << RF_BIT_FMT_HL))) {
+		/* Same signal, with the symbols shifted by half a symbol */
+		if (build_frame_variant(frames, HW_ROUTE_HL, config) >= 0) {
+			return HW_ROUTE_HL;
+		}
+
+		*failed = HW_ROUTE_HL;
+	}
+
+	if (config->bit_fmt != RF_BIT_FMT_RAW && (fmts & (1 << RF_BIT_FMT_RAW))
+			&& (!(fmts & (1 << config->bit_fmt)) || force_raw)) {
+		if (build_frame_variant(frames, HW_ROUTE_RAW, config) >= 0) {
+			return HW_ROUTE_RAW;
+		}
+
+		*failed = HW_ROUTE_RAW;
+		return HW_ROUTE_NONE;
+	}
+
+	if (!(fmts & (1 << config->bit_fmt))) {
+		return HW_ROUTE_NONE;
+	}
+
+	if ((config->preamble_bit_count > 0 || config->trailer_bit_count > 0) && !driver->caps->segmented_frames) {
+		/* Same signal, with every repetition written out */
+		if (build_frame_variant(frames, HW_ROUTE_UNROLLED, config) >= 0) {
+			return HW_ROUTE_UNROLLED;
+		}
+
+		*failed = HW_ROUTE_UNROLLED;
+		return HW_ROUTE_NONE;
+	}
+
+	return HW_ROUTE_NATIVE;
+}
+
+/*
+ * Whether a hardware driver is a better choice than another one for a frame:
+ * timings within HW_TIMING_ERROR_MAX first, then the one able to start first,
+ * then the most accurate one (the first one of the list on a tie)
+ */
+static int is_better_choice(struct hw_choice *a, struct hw_choice *b, char **reason) {
+	int a_accurate = (a->error <= HW_TIMING_ERROR_MAX * 10);
+	int b_accurate = (b->error <= HW_TIMING_ERROR_MAX * 10);
+
+	if (a_accurate != b_accurate) {
+		*reason = "timings accurate enough";
+		return a_accurate;
+	}
+
+	if (a_accurate && a->delay != b->delay) {
+		*reason = "ready first";
+		return a->delay < b->delay;
+	}
+
+	if (a->error != b->error) {
+		*reason = "most accurate timings";
+		return a->error < b->error;
+	}
+
+	*reason = "first in the list";
+
+	return 0;
+}
+
+/* Pick the best of the active hardware drivers for a frame, and tell why */
+static int choose_hw_driver(struct hw_choice *best, struct frame_variant *frames, struct timing_config *config, uint8_t force_raw, char *protocol_name) {
+	struct hw_choice choice, runner_up = {0};
+	struct rf_hardware_driver *driver;
+	struct frame_variant *frame;
+	hw_route_t failed;
+	char *reason = NULL;
+	unsigned int i;
+
+	best->driver = NULL;
+
+	for (i = 0; i < active_hw_count; i++) {
+		driver = active_hw_drivers[i];
+
+		choice.driver = driver;
+		choice.route = get_hw_route(driver, frames, config, force_raw, &failed);
+		if (choice.route == HW_ROUTE_NONE && failed != HW_ROUTE_NONE) {
+			if (active_hw_count == 1) {
+				fprintf(stderr, "%s - %s: Frame cannot be %s\n", driver->name, protocol_name, hw_route_str[(int) failed]);
+			} else {
+				dbg_printf(2, "  %s: Frame cannot be %s\n", driver->name, hw_route_str[(int) failed]);
+			}
+			continue;
+		}
+
+		if (choice.route == HW_ROUTE_NONE) {
+			if (active_hw_count == 1) {
+				fprintf(stderr, "%s - %s: Bit format %u not supported\n", driver->name, protocol_name, config->bit_fmt);
+			} else {
+				dbg_printf(2, "  %s: Bit format %s not supported\n", driver->name, rf_bit_fmt_str[(int) config->bit_fmt]);
+			}
+			continue;
+		}
+
+		frame = &frames[choice.route];
+		if (driver->caps->max_bit_count > 0 && frame->bit_count > driver->caps->max_bit_count) {
+			if (active_hw_count == 1) {
+				fprintf(stderr, "%s - %s: Frame too long (%d bits, %u max)\n", driver->name, protocol_name, frame->bit_count, driver->caps->max_bit_count);
+			} else {
+				dbg_printf(2, "  %s: Frame too long (%d bits %s, %u max)\n", driver->name, frame->bit_count,
+						hw_route_str[(int) choice.route], driver->caps->max_bit_count);
+			}
+			continue;
+		}
+
+		choice.error = get_timing_error(config, &frame->timings, driver->caps);
+		choice.delay = driver->caps->setup_time;
+		if (driver->get_busy_time) {
+			choice.delay += driver->get_busy_time();
+		}
+
+		if (active_hw_count > 1) {
+			dbg_printf(2, "  %s: Frame %s, timings within %u.%u%%, ready in %llu us\n", driver->name, hw_route_str[(int) choice.route],
+					choice.error/10, choice.error % 10, (unsigned long long) choice.delay);
+		}
+
+		if (best->driver == NULL) {
+			*best = choice;
+		} else if (is_better_choice(&choice, best, &reason)) {
+			runner_up = *best;
+			*best = choice;
+		} else if (runner_up.driver == NULL || is_better_choice(&choice, &runner_up, &reason)) {
+			runner_up = choice;
+		}
+	}
+
+	if (best->driver == NULL) {
+		if (active_hw_count > 1) {
+			fprintf(stderr, "%s: No hardware driver can send this frame\n", protocol_name);
+		}
+		return -1;
+	}
+
+	if (active_hw_count > 1) {
+		if (runner_up.driver == NULL) {
+			reason = "the only one able to send it";
+		} else {
+			is_better_choice(best, &runner_up, &reason);
+		}
+
+		dbg_printf(1, "  Using %s (%s)\n", best->driver->name, reason);
+
+		if (best->error > HW_TIMING_ERROR_MAX * 10) {
+			dbg_printf(1, "  Warning: timings off by up to %u.%u%% on %s\n", best->error/10, best->error % 10, best->driver->name);
+		}
+	}
+
+	return 0;
+}
+
 static int send_cmd(uint32_t remote_code, uint32_t device_code, rf_command_t command, int protocol, uint8_t force_raw) {
 	struct rf_protocol_driver *protocol_driver;
-	uint8_t data[MAX_FRAME_LENGTH];
-	int data_bit_count;
-	struct timing_config fallback_timings;
-	uint8_t fallback_data[MAX_FRAME_LENGTH];
-	int fallback_data_bit_count;
-	uint16_t base_time;
+	struct frame_variant frames[HW_ROUTE_MAX];
+	struct frame_variant *frame;
+	struct hw_choice choice;
+	unsigned int count;
 	int ret = 0;
 	int i;
 
 	protocol_driver = get_protocol_driver_by_id(protocol);
 
-	data_bit_count = protocol_driver->format_cmd(data, sizeof(data), remote_code, device_code, command);
-	if (data_bit_count < 0) {
-		fprintf(stderr, "%s - %s: Format command failed\n", current_hw_driver->name, protocol_driver->name);
-		return data_bit_count;
+	frame = &frames[HW_ROUTE_NATIVE];
+	frame->timings = *protocol_driver->timings;
+
+	/* The drivers handling the segments send the repetitions of every sequence after a single preamble */
+	if (frame->timings.sequence_count > 1) {
+		count = (unsigned int) frame->timings.frame_count * frame->timings.sequence_count;
+		frame->timings.frame_count = (count > UINT8_MAX) ? UINT8_MAX : count;
+		frame->timings.sequence_count = 0;
+	}
+	memset(frame->data, 0, sizeof(frame->data));
+	frame->bit_count = protocol_driver->format_cmd(frame->data, sizeof(frame->data), remote_code, device_code, command);
+	if (frame->bit_count < 0) {
+		fprintf(stderr, "%s: Format command failed\n", protocol_driver->name);
+		return frame->bit_count;
+	}
+
+	if ((frame->timings.preamble_bit_count > 0 || frame->timings.trailer_bit_count > 0) && (frame->timings.bit_fmt != RF_BIT_FMT_RAW
+			|| frame->timings.preamble_bit_count + frame->timings.trailer_bit_count >= frame->bit_count)) {
+		fprintf(stderr, "%s: Invalid preamble (%u bits) or trailer (%u bits)\n", protocol_driver->name,
+				frame->timings.preamble_bit_count, frame->timings.trailer_bit_count);
+		return -1;
 	}
 
+	frames[HW_ROUTE_HL].bit_count = FRAME_NOT_BUILT;
+	frames[HW_ROUTE_RAW].bit_count = FRAME_NOT_BUILT;
+	frames[HW_ROUTE_UNROLLED].bit_count = FRAME_NOT_BUILT;
+
 	printf("Sending %s command '%s'", protocol_drivers[protocol]->name, rf_command_str[(int) command]);
 
 	if (protocol_drivers[protocol]->needed_params & PARAM_DEVICE_ID) {
@@ -485,62 +884,92 @@ static int send_cmd(uint32_t remote_code, uint32_t device_code, rf_command_t com
 			case RF_BIT_FMT_RAW:
 				dbg_printf(3, "  Timings (%s): Base HLTime %u us\n", protocol_driver->name,
 						protocol_driver->timings->base_time);
+				if (protocol_driver->timings->preamble_bit_count > 0 || protocol_driver->timings->trailer_bit_count > 0) {
+					dbg_printf(3, "  Timings (%s): Preamble %u bits - Trailer %u bits\n", protocol_driver->name,
+							protocol_driver->timings->preamble_bit_count, protocol_driver->timings->trailer_bit_count);
+				}
 				break;
 		}
 	}
 
 	if (is_dbg_enabled(1)) {
 		dbg_printf(1, "  Frame data (%s):", protocol_driver->name);
-		for (i = 0; i < (data_bit_count + 7)/8; i++) {
-			dbg_printf(1, " %02X", data[i]);
+		for (i = 0; i < (frame->bit_count + 7)/8; i++) {
+			dbg_printf(1, " %02X", frame->data[i]);
 		}
 		dbg_printf(1, "\n");
 	}
 
-	if (protocol_driver->timings->bit_fmt != RF_BIT_FMT_RAW && (!(current_hw_driver->supported_bit_fmts & (1 << protocol_driver->timings->bit_fmt)) || force_raw)) {
-		if (current_hw_driver->supported_bit_fmts & (1 << RF_BIT_FMT_RAW)) {
-			dbg_printf(1, "\n");
-			if (!force_raw) {
-				dbg_printf(1, "  Requested bit format not supported by %s, falling back to RAW\n", current_hw_driver->name);
-			}
-
-			/* Generate a RAW frame */
-			base_time = find_best_base_time(protocol_driver->timings);
+	if (choose_hw_driver(&choice, frames, protocol_driver->timings, force_raw, protocol_driver->name) < 0) {
+		return -1;
+	}
 
-			fallback_data_bit_count = raw_generate_hl_frame(fallback_data, sizeof(fallback_data), protocol_driver->timings, data, (uint16_t) data_bit_count, base_time);
+	frame = &frames[choice.route];
 
-			fallback_timings.base_time = base_time;
-			fallback_timings.bit_fmt = RF_BIT_FMT_RAW;
-			fallback_timings.frame_count = protocol_driver->timings->frame_count;
+	if (choice.route == HW_ROUTE_HL && is_dbg_enabled(1)) {
+		dbg_printf(1, "\n");
+		dbg_printf(1, "  LH bit format not supported by %s, rewritten as HL\n", choice.driver->name);
+		dbg_printf(3, "  HL Timings (%s): Start-bit HTime %u us - Start-bit LTime %u us\n", protocol_driver->name,
+				frame->timings.start_bit_h_time, frame->timings.start_bit_l_time);
+		dbg_printf(3, "  HL Timings (%s): End-bit HTime %u us - End-bit LTime %u us\n", protocol_driver->name,
+				frame->timings.end_bit_h_time, frame->timings.end_bit_l_time);
+		dbg_printf(3, "  HL Timings (%s): Data-bit0 HTime %u us - Data-bit0 LTime %u us\n", protocol_driver->name,
+				frame->timings.data_bit0_h_time, frame->timings.data_bit0_l_time);
+		dbg_printf(3, "  HL Timings (%s): Data-bit1 HTime %u us - Data-bit1 LTime %u us\n", protocol_driver->name,
+				frame->timings.data_bit1_h_time, frame->timings.data_bit1_l_time);
+
+		dbg_printf(1, "  HL Frame data (%s):", protocol_driver->name);
+		for (i = 0; i < (frame->bit_count + 7)/8; i++) {
+			dbg_printf(1, " %02X", frame->data[i]);
+		}
+		dbg_printf(1, "\n");
+	} else if (choice.route == HW_ROUTE_RAW && is_dbg_enabled(1)) {
+		dbg_printf(1, "\n");
+		if (!force_raw) {
+			dbg_printf(1, "  Requested bit format not supported by %s, falling back to RAW\n", choice.driver->name);
+		}
 
-			if (is_dbg_enabled(1)) {
-				dbg_printf(3, "  RAW Timings (%s): Base HLTime %u us\n", protocol_driver->name,
-						fallback_timings.base_time);
+		dbg_printf(3, "  RAW Timings (%s): Base HLTime %u us\n", protocol_driver->name,
+				frame->timings.base_time);
 
-				dbg_printf(1, "  RAW Frame data (%s):", protocol_driver->name);
-				for (i = 0; i < (fallback_data_bit_count + 7)/8; i++) {
-					dbg_printf(1, " %02X", fallback_data[i]);
-				}
-				dbg_printf(1, "\n");
-			}
+		dbg_printf(1, "  RAW Frame data (%s):", protocol_driver->name);
+		for (i = 0; i < (frame->bit_count + 7)/8; i++) {
+			dbg_printf(1, " %02X", frame->data[i]);
+		}
+		dbg_printf(1, "\n");
+	} else if (choice.route == HW_ROUTE_UNROLLED && is_dbg_enabled(1)) {
+		dbg_printf(1, "\n");
+		dbg_printf(1, "  Preamble and trailer not supported by %s, frame unrolled\n", choice.driver->name);
 
-			ret = current_hw_driver->send_cmd(&fallback_timings, fallback_data, (uint16_t) fallback_data_bit_count);
-		} else {
-			fprintf(stderr, "%s - %s: Bit format %u not supported\n", current_hw_driver->name, protocol_driver->name, protocol_driver->timings->bit_fmt);
-			return -1;
+		dbg_printf(1, "  Unrolled Frame data (%s):", protocol_driver->name);
+		for (i = 0; i < (frame->bit_count + 7)/8; i++) {
+			dbg_printf(1, " %02X", frame->data[i]);
 		}
-	} else {
-		ret = current_hw_driver->send_cmd(protocol_driver->timings, data, (uint16_t) data_bit_count);
+		dbg_printf(1, "\n");
 	}
 
+	ret = choice.driver->send_cmd(&frame->timings, frame->data, (uint16_t) frame->bit_count);
+
 	if (ret < 0) {
-		fprintf(stderr, "%s - %s: configuration failed\n", current_hw_driver->name, protocol_driver->name);
+		fprintf(stderr, "%s - %s: configuration failed\n", choice.driver->name, protocol_driver->name);
 		return ret;
 	}
 
 	return 0;
 }
 
+/*
+ * Apply the number of frames given by the user. With a preamble or a trailer, the default
+ * count is for one whole sequence (e.g. the Somfy repetitions), so the user gives sequences.
+ */
+static void force_frame_count(struct timing_config *timings, int nframe) {
+	if (timings->preamble_bit_count > 0 || timings->trailer_bit_count > 0) {
+		timings->sequence_count = nframe;
+	} else {
+		timings->frame_count = nframe;
+	}
+}
+
 static void usage(FILE * fp, int argc, char **argv) {
 	int i;
 
@@ -548,16 +977,20 @@ static void usage(FILE * fp, int argc, char **argv) {
 		APP_NAME" v"APP_VERSION" - (C)"COPYRIGHT_DATE" "AUTHOR_NAME"\n\n"
 		"Usage: %s [options]\n\n"
 		"Options:\n"
-		"  -H | --hw <hardware>       Hardware driver to use (otherwise try to auto-detect)\n"
+		"  -H | --hw <hardware>       Hardware driver(s) to use, comma-separated, the best one being picked for each frame (otherwise use every auto-detected one)\n"
+		"  -D | --hw-device <dev>     Hardware device(s) to use, comma-separated (only for hardware drivers supporting it),\n"
+		"                             as <hardware>:<dev> for a single driver (can be repeated), otherwise for every driver\n"
 		"  -p | --proto <protocol>    Protocol to use\n"
 		"  -r | --remote <id>         Remote ID to take\n"
 		"  -d | --device <id>         Device ID to reach\n"
 		"  -c | --command <command>   Command to send\n"
 		"  -s | --scan                Perform a brute force scan (-p, -r and -d can be used to force specific values)\n"
-		"  -n | --nframe <0-255>      Number of frames to send (override per protocol default value)\n"
+		"  -n | --nframe <0-255>      Number of frames to send (override per protocol default value), or of whole sequences\n"
+		"                             for the protocols repeating frames after a preamble (Somfy)\n"
 		"  -a | --accuracy <0-100>    Accuracy of the timings in percent when HL frames are converted to RAW (default %u%%)\n"
 		"  -R | --raw                 Convert HL frames to RAW if possible\n"
 		"  -g | --gpio <num>          Which GPIO to use to transmit the signal (only for hardware drivers supporting it)\n"
+		"  -k | --keep-gpio           Leave the GPIO exported and configured on exit (only for hardware drivers supporting it)\n"
 		"  -v | --verbose             Print more detailed information (-vv and -vvv for even more details)\n"
 		"  -h | --help                Print this message\n\n",
 		argv[0], DEFAULT_RAW_FALLBACK_ACCURACY);
@@ -599,10 +1032,11 @@ static void usage(FILE * fp, int argc, char **argv) {
 
 }
 
-static const char short_options[] = "H:p:r:d:c:sn:a:Rg:vh";
+static const char short_options[] = "H:D:p:r:d:c:sn:a:Rg:kvh";
 
 static const struct option long_options[] = {
 	{"hw", required_argument, NULL, 'H'},
+	{"hw-device", required_argument, NULL, 'D'},
 	{"proto", required_argument, NULL, 'p'},
 	{"remote", required_argument, NULL, 'r'},
 	{"device", required_argument, NULL, 'd'},
@@ -612,6 +1046,7 @@ static const struct option long_options[] = {
 	{"accuracy", required_argument, NULL, 'a'},
 	{"raw", no_argument, NULL, 'R'},
 	{"gpio", required_argument, NULL, 'g'},
+	{"keep-gpio", no_argument, NULL, 'k'},
 	{"verbose", required_argument, NULL, 'v'},
 	{"help", no_argument, NULL, 'h'},
 	{0, 0, 0, 0}
@@ -620,20 +1055,23 @@ static const struct option long_options[] = {
 int main(int argc, char **argv)
 {
 	int ret = 0;
-	int hw = -1;
+	uint32_t hw_mask = 0;
+	uint8_t hw_auto_detected = 0;
 	int nframe = -1;
 	int protocol = -1, command = -1;
 	uint8_t force_raw = 0;
 	uint32_t remote_id = 0, device_id = 0;
 	uint8_t needed_params = PARAM_PROTOCOL | PARAM_REMOTE_ID | PARAM_DEVICE_ID | PARAM_COMMAND;
 	uint16_t provided_params = 0;
+	uint16_t hw_provided_params;
 	uint32_t proto_first = 0, proto_last = 0, remote_first = 0, remote_last = 0, device_first = 0, device_last = 0;
-	struct rf_hardware_params hw_params;
+	struct rf_hardware_params hw_params = {0};
+	struct rf_hardware_driver *hw_driver;
 	char * p;
 	uint32_t i, j, k;
 
 	/* Parse the configuration file first */
-	parse_config_file(&provided_params, &hw, &hw_params);
+	parse_config_file(&provided_params, &hw_mask, &hw_params);
 
 	for (;;) {
 		int index;
@@ -649,12 +1087,7 @@ int main(int argc, char **argv)
 				break;
 
 			case 'H':
-				hw = strtoul(optarg, &p, 0);
-				if (*p != '\0') {
-					hw = get_hw_id_by_name(optarg);
-				}
-
-				if (hw < 0 || hw >= ARRAY_SIZE(hardware_drivers)) {
+				if (parse_hw_list(optarg, &hw_mask) < 0) {
 					fprintf(stderr, "Unsupported RF hardware %s\n", optarg);
 					usage(stderr, argc, argv);
 					return -1;
@@ -663,6 +1096,11 @@ int main(int argc, char **argv)
 				provided_params |= PARAM_HARDWARE;
 				break;
 
+			case 'D':
+				set_hw_device(optarg);
+				provided_params |= PARAM_HW_DEVICE;
+				break;
+
 			case 'p':
 				protocol = strtoul(optarg, &p, 0);
 				if (*p != '\0') {
@@ -735,6 +1173,10 @@ int main(int argc, char **argv)
 				provided_params |= PARAM_GPIO;
 				break;
 
+			case 'k':
+				provided_params |= PARAM_GPIO_KEEP;
+				break;
+
 			case 'v':
 				debug_level++;
 				provided_params |= PARAM_VERBOSE;
@@ -764,28 +1206,53 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	if (hw < 0) {
-		/* Try to auto-detect */
-		current_hw_driver = auto_detect_hw_driver();
-		if (!current_hw_driver) {
-			fprintf(stderr, "Cannot auto-detect HW driver\n");
-			return -1;
+	if (hw_mask == 0) {
+		/* Use what a previous run detected, otherwise try to auto-detect */
+		hw_auto_detected = 1;
+		hw_mask = probe_cache_load(hardware_drivers, ARRAY_SIZE(hardware_drivers));
+		if (hw_mask == 0) {
+			hw_mask = auto_detect_hw_drivers();
+			if (hw_mask == 0) {
+				fprintf(stderr, "Cannot auto-detect HW driver\n");
+				return -1;
+			}
+
+			probe_cache_save(hardware_drivers, ARRAY_SIZE(hardware_drivers), hw_mask);
 		}
-	} else {
-		current_hw_driver = get_hw_driver_by_id(hw);
-		if (!current_hw_driver) {
-			fprintf(stderr, "Cannot find HW driver with index %d\n", hw);
-			return -1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(hardware_drivers); i++) {
+		if ((hw_mask & (1 << i)) && load_hw_driver(hardware_drivers[i]) < 0) {
+			fprintf(stderr, "Cannot load %s driver\n", hardware_drivers[i]->name);
+			hw_mask &= ~(1 << i);
+
+			if (hw_auto_detected) {
+				probe_cache_invalidate();
+			}
 		}
 	}
 
-	hw_params.provided_params = provided_params;
+	if (hw_mask == 0) {
+		return -1;
+	}
 
-	if (current_hw_driver->needed_hw_params & ~(provided_params)) {
-		fprintf(stderr, "Missing arguments specific to the %s driver:", current_hw_driver->name);
-		for (i = 0; i < ARRAY_SIZE(parameter_str); i++) {
-			if ((current_hw_driver->needed_hw_params & ~(provided_params)) & (0x1 << i)) {
-				fprintf(stderr, " %s", parameter_str[i]);
+	for (i = 0; i < ARRAY_SIZE(hardware_drivers); i++) {
+		hw_driver = hardware_drivers[i];
+
+		/* The device may only be given to some of the drivers */
+		hw_provided_params = provided_params & ~PARAM_HW_DEVICE;
+		if (get_hw_device(i) != NULL) {
+			hw_provided_params |= PARAM_HW_DEVICE;
+		}
+
+		if (!(hw_mask & (1 << i)) || !(hw_driver->needed_hw_params & ~(hw_provided_params))) {
+			continue;
+		}
+
+		fprintf(stderr, "Missing arguments specific to the %s driver:", hw_driver->name);
+		for (j = 0; j < ARRAY_SIZE(parameter_str); j++) {
+			if ((hw_driver->needed_hw_params & ~(hw_provided_params)) & (0x1 << j)) {
+				fprintf(stderr, " %s", parameter_str[j]);
 			}
 		}
 		fprintf(stderr, " !\n");
@@ -793,22 +1260,56 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	printf("Initializing %s driver...\n", current_hw_driver->long_name);
-	ret = current_hw_driver->init(&hw_params);
-	if (ret < 0) {
-		fprintf(stderr, "Cannot initialize %s driver\n", current_hw_driver->name);
+	for (i = 0; i < ARRAY_SIZE(hardware_drivers); i++) {
+		hw_driver = hardware_drivers[i];
+		if (!(hw_mask & (1 << i))) {
+			continue;
+		}
+
+		hw_params.device = get_hw_device(i);
+		hw_params.provided_params = provided_params & ~PARAM_HW_DEVICE;
+		if (hw_params.device != NULL) {
+			hw_params.provided_params |= PARAM_HW_DEVICE;
+		}
+
+		printf("Initializing %s driver...\n", hw_driver->long_name);
+		ret = hw_driver->init(&hw_params);
+		if (ret < 0) {
+			fprintf(stderr, "Cannot initialize %s driver\n", hw_driver->name);
+			hw_driver->close();
+
+			/*
+			 * The hardware may have changed, it will be detected again by the next run,
+			 * unless a device was given, which a new detection would not change
+			 */
+			if (hw_auto_detected && hw_params.device == NULL) {
+				probe_cache_invalidate();
+			}
+			continue;
+		}
+
+		active_hw_drivers[active_hw_count++] = hw_driver;
+	}
+
+	if (active_hw_count == 0) {
 		goto exit;
 	}
 
+	/* The other drivers can do without the ones that failed */
+	ret = 0;
+
 	if (nframe > 0) {
 		printf("Number of frames forced to %d\n", nframe);
 	}
 
 	if (provided_params & PARAM_RAW) {
-		if (!(current_hw_driver->supported_bit_fmts & (1 << RF_BIT_FMT_RAW))) {
-			printf("Warning: %s does not support the RAW format, ignoring RAW conversion\n", current_hw_driver->name);
-		} else {
-			force_raw = 1;
+		/* Only applies to the drivers supporting RAW */
+		for (i = 0; i < active_hw_count; i++) {
+			if (!(active_hw_drivers[i]->supported_bit_fmts & (1 << RF_BIT_FMT_RAW))) {
+				printf("Warning: %s does not support the RAW format, ignoring RAW conversion\n", active_hw_drivers[i]->name);
+			} else {
+				force_raw = 1;
+			}
 		}
 	}
 
@@ -836,7 +1337,7 @@ int main(int argc, char **argv)
 
 		for (i = proto_first; i <= proto_last; i++) {
 			if (nframe > 0) {
-				protocol_drivers[i]->timings->frame_count = nframe;
+				force_frame_count(protocol_drivers[i]->timings, nframe);
 			}
 
 			if (!(provided_params & PARAM_REMOTE_ID)) {
@@ -859,14 +1360,27 @@ int main(int argc, char **argv)
 		}
 	} else {
 		if (nframe > 0) {
-			protocol_drivers[protocol]->timings->frame_count = nframe;
+			force_frame_count(protocol_drivers[protocol]->timings, nframe);
 		}
 
 		ret = send_cmd(remote_id, device_id, (rf_command_t) command, protocol, force_raw);
+		if (ret < 0 && hw_auto_detected) {
+			probe_cache_invalidate();
+		}
 	}
 
 exit:
-	current_hw_driver->close();
+	for (i = 0; i < active_hw_count; i++) {
+		active_hw_drivers[i]->close();
+	}
+
+	code_store_close();
+
+	for (i = 0; i <= HW_DEVICE_ANY; i++) {
+		free(hw_devices[i]);
+	}
+	free(hw_params.alsa_format);
+	free(hw_params.he853_calibration);
 
 	return ret;
 }
@@ -32,6 +32,8 @@
 #define PARAM_RAW			0X0100
 #define PARAM_GPIO			0X0200
 #define PARAM_VERBOSE			0X0400
+#define PARAM_GPIO_KEEP			0X0800
+#define PARAM_HW_DEVICE			0X1000
 
 #define STORAGE_PATH_MAX_LEN		512
 
@@ -68,20 +70,53 @@ struct timing_config {
 	uint16_t base_time;
 	rf_bit_fmt_t bit_fmt;
 	uint8_t frame_count;
+	/*
+	 * RAW only: the first preamble_bit_count bits of the frame are only sent before the
+	 * first repetition, and the last trailer_bit_count bits only after the last one
+	 */
+	uint16_t preamble_bit_count;
+	uint16_t trailer_bit_count;
+	/*
+	 * With a preamble or a trailer: number of whole sequences to send (0 meaning 1), the
+	 * unrolled sequence being repeated, and the repetitions multiplied otherwise
+	 */
+	uint8_t sequence_count;
 };
 
 /* List of parameters that a hardware driver might use */
 struct rf_hardware_params {
 	uint8_t gpio;
+	char *device;
+	uint8_t alsa_continuous;
+	uint8_t alsa_dual_channel;
+	uint32_t alsa_rate;
+	uint8_t alsa_channels;
+	char *alsa_format;
+	char *he853_calibration;
 	uint16_t provided_params;
 };
 
+/*
+ * What a hardware driver can achieve, so that the best one can be picked for each frame
+ * when several are in use. Drivers may refine it in init() (e.g. from the sample rate).
+ */
+struct rf_hardware_caps {
+	uint16_t max_bit_count;		/* per frame, as given to send_cmd(), 0 if unlimited */
+	uint16_t time_step;		/* us, resolution of the generated timings */
+	uint32_t setup_time;		/* us, spent before the frame starts being transmitted */
+	uint8_t segmented_frames;	/* handles the preamble and trailer of RAW frames, otherwise they are unrolled */
+	uint32_t (*quantize_time)(uint32_t time, uint8_t high);	/* us actually sent for a pulse, optional, otherwise rounded to time_step */
+};
+
 struct rf_hardware_driver {
 	char *name;
 	char *cmd_name;
 	char *long_name;
 	uint8_t supported_bit_fmts;
 	uint16_t needed_hw_params;
+	struct rf_hardware_caps *caps;
+	uint32_t (*get_busy_time)(void);	/* us before a new frame can start, optional */
+	int (*get_probe_path)(char *path, size_t len);	/* file present as long as the probed device is, optional */
 	int (*probe)(void);
 	int (*init)(struct rf_hardware_params *params);
 	void (*close)(void);
@@ -100,6 +135,5 @@ struct rf_protocol_driver {
 
 int is_dbg_enabled(int level);
 void dbg_printf(int level, char *buff, ...);
-void get_storage_path(char *path, struct rf_protocol_driver *protocol);
 
 #endif /* _RF_CTRL_H_ */
@@ -26,13 +26,23 @@
 
 #include "rf-ctrl.h"
 #include "raw.h"
+#include "code-store.h"
 
 #define PROTOCOL_NAME		"Somfy RTS"
 
 #define SOMFY_FRAME_COUNT	10
+#define SOMFY_FIRST_BIT_COUNT	213
+#define SOMFY_BIT_COUNT		(SOMFY_FIRST_BIT_COUNT + 225)
+#define SOMFY_DATA_BIT_COUNT	(7 * 8 * 2)
 
 struct rf_protocol_driver somfy_driver;
 
+/* The first frame (sent once) and the following one (repeated), without their data */
+static uint8_t template_data[(SOMFY_BIT_COUNT + 7)/8];
+static struct raw_template somfy_template = {
+	.data = template_data,
+};
+
 
 static size_t write_pulses(uint8_t *buf, size_t offset, uint8_t pulses) {
 	size_t count = offset;
@@ -90,17 +100,48 @@ static size_t write_data(uint8_t *buf, size_t offset, uint16_t rolling_code, uin
 	return (count - offset);
 }
 
+static int build_template(void) {
+	size_t count = 0;
+	uint8_t i;
+
+	for (i = 0; i < 2; i++) {
+		/* Starting/sync pulses */
+		if (i == 0) {
+			/* First frame */
+			/* Big starting pulse (16 x high, 12 x low) */
+			count += raw_write_high(template_data, count, 16);
+			count += raw_write_low(template_data, count, 12);
+
+			/* Then 2 regular starting pulses */
+			count += write_pulses(template_data, count, 2);
+		} else {
+			/* Following frames (7 regular starting pulses) */
+			count += write_pulses(template_data, count, 7);
+		}
+
+		/* Actual data, the same in both frames */
+		if (raw_template_add_field(&somfy_template, count, SOMFY_DATA_BIT_COUNT, 0) < 0) {
+			return -1;
+		}
+		count += SOMFY_DATA_BIT_COUNT;
+
+		/* Gap before the next frame (48 x low = ~30ms) */
+		count += raw_write_low(template_data, count, 48);
+	}
+
+	somfy_template.bit_count = count;
+
+	return 0;
+}
+
 static int somfy_format_cmd(uint8_t *data, size_t data_len, uint32_t remote_code, uint32_t device_code, rf_command_t command) {
-	const int bit_count = 213 + (SOMFY_FRAME_COUNT - 1) * 225;
+	uint8_t frame_data[SOMFY_DATA_BIT_COUNT/8] = {0};
 	uint8_t raw_cmd; 		// 4 bits
-	uint16_t rolling_code = 0;
-	char data_file_path[STORAGE_PATH_MAX_LEN];
-	FILE * f;
-        size_t count = 0;
-	uint8_t i;
+	uint16_t rolling_code;
+	uint32_t code;
 
-	if (data_len * 8 < bit_count) {
-		fprintf(stderr, "%s: data buffer too small (%lu available, %d needed)\n", PROTOCOL_NAME, (unsigned long) data_len, (bit_count + 7)/8);
+	if (data_len * 8 < SOMFY_BIT_COUNT) {
+		fprintf(stderr, "%s: data buffer too small (%lu available, %d needed)\n", PROTOCOL_NAME, (unsigned long) data_len, (SOMFY_BIT_COUNT + 7)/8);
 		return -1;
 	}
 
@@ -131,61 +172,28 @@ static int somfy_format_cmd(uint8_t *data, size_t data_len, uint32_t remote_code
 	}
 
 	/* Get the current rolling code for that device and remote */
-	get_storage_path(data_file_path, &somfy_driver);
-	snprintf(data_file_path + strlen(data_file_path), STORAGE_PATH_MAX_LEN, "/%02X.%06X", remote_code, device_code);
-
-	dbg_printf(3, "%s: Data file is %s\n", PROTOCOL_NAME, data_file_path);
-
-	f = fopen(data_file_path, "r+");
-	if (f == NULL) {
-		f = fopen(data_file_path, "w+");
-		if (f == NULL) {
-			fprintf(stderr, "%s: Cannot open %s\n", PROTOCOL_NAME, data_file_path);
-			return -1;
-		}
-	}
-
-	if (fscanf(f, "%04hX", &rolling_code) != 1) {
-		dbg_printf(2, "%s: Rolling code initialized to 0\n", PROTOCOL_NAME);
+	if (code_store_next(somfy_driver.cmd_name, remote_code, device_code, &code) < 0) {
+		return -1;
 	}
-
-	fseek(f, 0, SEEK_SET);
-	fprintf(f, "%04X\n", (rolling_code + 1) % 0x10000);
-
-	fclose(f);
+	rolling_code = code & 0xFFFF;
 
 	dbg_printf(1, "%s: Rolling code at %04X\n", PROTOCOL_NAME, rolling_code);
 
-	/* Generate the whole frame */
-	for (i = 0; i < SOMFY_FRAME_COUNT; i++) {
-		/* Starting/sync pulses */
-		if (i == 0) {
-			/* First frame */
-			/* Big starting pulse (16 x high, 12 x low) */
-			count += raw_write_high(data, count, 16);
-			count += raw_write_low(data, count, 12);
-
-			/* Then 2 regular starting pulses */
-			count += write_pulses(data, count, 2);
-		} else {
-			/* Following frames (7 regular starting pulses) */
-			count += write_pulses(data, count, 7);
-		}
-
-		/* Actual data */
-		count += write_data(data, count, rolling_code, remote_code, device_code, raw_cmd);
-
-		/* Gap before the next frame (48 x low = ~30ms) */
-		count += raw_write_low(data, count, 48);
+	/* Only the data changes from one command to another */
+	if (somfy_template.bit_count == 0 && build_template() < 0) {
+		return -1;
 	}
 
-	return bit_count;
+	write_data(frame_data, 0, rolling_code, remote_code, device_code, raw_cmd);
+
+	return raw_template_apply(&somfy_template, data, data_len, frame_data);
 }
 
 static struct timing_config somfy_timings = {
 	.base_time = 625,		// 625 us
 	.bit_fmt = RF_BIT_FMT_RAW,
-	.frame_count = 1,		// the sequence of frames is generated as one
+	.frame_count = SOMFY_FRAME_COUNT - 1,	// after the first one, with a longer wake-up pulse and fewer starting pulses
+	.preamble_bit_count = SOMFY_FIRST_BIT_COUNT,
 };
 
 struct rf_protocol_driver somfy_driver = {
@@ -39,7 +39,15 @@
 #define GPIO_SYSFS_DIRECTION		"direction"		// At root/gpio<num> level
 #define GPIO_SYSFS_VALUE		"value"			// At root/gpio<num> level
 
+#define GPIO_SYSFS_PATH_MAX		256
+#define GPIO_SYSFS_OPEN_RETRY_DELAY	5000			// us
+#define GPIO_SYSFS_OPEN_RETRY_MAX	40			// 200 ms, the time for udev to fix the permissions
+
+#define GPIO_SYSFS_TIME_STEP		60			// us, usleep() overshoot and write() latency, roughly
+
 static uint16_t gpio_num;
+static int value_fd = -1;
+static uint8_t keep_exported = 0;
 
 
 static int sysfs_gpio_probe(void) {
@@ -47,20 +55,29 @@ static int sysfs_gpio_probe(void) {
 	return -1;
 }
 
-static int sysfs_gpio_init(struct rf_hardware_params *params) {
-	FILE *f;
-	char path[256];
+/*
+ * Freshly exported GPIOs may be owned by root until udev
+ * fixes their permissions, so retry for a little while.
+ */
+static int sysfs_gpio_open_retry(const char *path, int flags) {
+	int fd;
+	int i;
 
-	if (!(params->provided_params & PARAM_GPIO)) {
-		fprintf(stderr, "%s: GPIO parameter missing !\n", HARDWARE_NAME);
-		return -1;
+	for (i = 0; i < GPIO_SYSFS_OPEN_RETRY_MAX; i++) {
+		fd = open(path, flags);
+		if (fd >= 0 || (errno != EACCES && errno != ENOENT)) {
+			break;
+		}
+
+		usleep(GPIO_SYSFS_OPEN_RETRY_DELAY);
 	}
 
-	gpio_num = params->gpio;
+	return fd;
+}
 
-	printf("%s: Using GPIO %u\n", HARDWARE_NAME, gpio_num);
+static int sysfs_gpio_export(void) {
+	FILE *f;
 
-	/* Export the GPIO used by the transmitter */
 	f = fopen(GPIO_SYSFS_ROOT"/"GPIO_SYSFS_EXPORT, "w");
 	if (f == NULL) {
 		fprintf(stderr, "%s: Unable to open %s !\n", HARDWARE_NAME, GPIO_SYSFS_ROOT"/"GPIO_SYSFS_EXPORT);
@@ -71,18 +88,79 @@ static int sysfs_gpio_init(struct rf_hardware_params *params) {
 
 	fclose(f);
 
-	/* Set the direction of the GPIO as output */
-	snprintf(path, 256, "%s/gpio%u/%s", GPIO_SYSFS_ROOT, gpio_num, GPIO_SYSFS_DIRECTION);
+	return 0;
+}
 
-	f = fopen(path, "w");
-	if (f == NULL) {
-		fprintf(stderr, "%s: Unable to open %s !\n", HARDWARE_NAME, path);
+static int sysfs_gpio_set_output(void) {
+	int fd;
+	char path[GPIO_SYSFS_PATH_MAX];
+	char direction[8] = {0};
+
+	snprintf(path, GPIO_SYSFS_PATH_MAX, "%s/gpio%u/%s", GPIO_SYSFS_ROOT, gpio_num, GPIO_SYSFS_DIRECTION);
+
+	fd = sysfs_gpio_open_retry(path, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "%s: Unable to open %s (%s) !\n", HARDWARE_NAME, path, strerror(errno));
 		return -1;
 	}
 
-	fprintf(f, "out\n");
+	/* Nothing to do if the GPIO is already configured as output */
+	if (read(fd, direction, sizeof(direction) - 1) > 0 && !strncmp(direction, "out", 3)) {
+		dbg_printf(2, "%s: GPIO %u already configured as output\n", HARDWARE_NAME, gpio_num);
+		close(fd);
+		return 0;
+	}
 
-	fclose(f);
+	/* Setting the direction to "low" also makes sure the transmitter is off */
+	if (pwrite(fd, "low\n", 4, 0) < 0) {
+		fprintf(stderr, "%s: Unable to set GPIO %u as output (%s) !\n", HARDWARE_NAME, gpio_num, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static int sysfs_gpio_init(struct rf_hardware_params *params) {
+	struct stat st;
+	char path[GPIO_SYSFS_PATH_MAX];
+
+	if (!(params->provided_params & PARAM_GPIO)) {
+		fprintf(stderr, "%s: GPIO parameter missing !\n", HARDWARE_NAME);
+		return -1;
+	}
+
+	gpio_num = params->gpio;
+	keep_exported = (params->provided_params & PARAM_GPIO_KEEP) ? 1 : 0;
+
+	printf("%s: Using GPIO %u\n", HARDWARE_NAME, gpio_num);
+
+	/* Export the GPIO used by the transmitter, unless it is already there */
+	snprintf(path, GPIO_SYSFS_PATH_MAX, "%s/gpio%u", GPIO_SYSFS_ROOT, gpio_num);
+
+	if (stat(path, &st) < 0) {
+		if (sysfs_gpio_export() < 0) {
+			return -1;
+		}
+	} else {
+		dbg_printf(2, "%s: GPIO %u already exported\n", HARDWARE_NAME, gpio_num);
+	}
+
+	/* Set the direction of the GPIO as output */
+	if (sysfs_gpio_set_output() < 0) {
+		return -1;
+	}
+
+	/* Keep the value file open for the whole session */
+	snprintf(path, GPIO_SYSFS_PATH_MAX, "%s/gpio%u/%s", GPIO_SYSFS_ROOT, gpio_num, GPIO_SYSFS_VALUE);
+
+	value_fd = sysfs_gpio_open_retry(path, O_WRONLY | O_SYNC);
+	if (value_fd < 0) {
+		fprintf(stderr, "%s: Unable to open %s (%s) !\n", HARDWARE_NAME, path, strerror(errno));
+		return -1;
+	}
 
 	return 0;
 }
@@ -90,6 +168,16 @@ static int sysfs_gpio_init(struct rf_hardware_params *params) {
 static void sysfs_gpio_close(void) {
 	FILE *f;
 
+	if (value_fd >= 0) {
+		close(value_fd);
+		value_fd = -1;
+	}
+
+	if (keep_exported) {
+		/* Leave the GPIO exported and configured for the next invocation */
+		return;
+	}
+
 	/* Release the GPIO used by the transmitter */
 	f = fopen(GPIO_SYSFS_ROOT"/"GPIO_SYSFS_UNEXPORT, "w");
 	if (f == NULL) {
@@ -103,17 +191,13 @@ static void sysfs_gpio_close(void) {
 }
 
 static int sysfs_gpio_send_cmd(struct timing_config *config, uint8_t *frame_data, uint16_t bit_count) {
-	int fd;
-	char path[256];
-	uint16_t i, j;
+	int fd = value_fd;
+	uint16_t i, j, first, last;
 	char old_bit, new_bit;
 
-	snprintf(path, 256, "%s/gpio%u/%s", GPIO_SYSFS_ROOT, gpio_num, GPIO_SYSFS_VALUE);
-
-	fd = open(path, O_WRONLY| O_SYNC);
 	if (fd < 0) {
-		fprintf(stderr, "%s: Unable to open %s (%s) !\n", HARDWARE_NAME, path, strerror(errno));
-		return fd;
+		fprintf(stderr, "%s: GPIO %u not initialized !\n", HARDWARE_NAME, gpio_num);
+		return -1;
 	}
 
 	for (j = 0; j < config->frame_count; j++) {
@@ -141,9 +225,13 @@ static int sysfs_gpio_send_cmd(struct timing_config *config, uint8_t *frame_data
 				break;
 		}
 
+		/* The first repetition starts with the preamble, and the last one ends with the trailer */
+		first = (j == 0) ? 0 : config->preamble_bit_count;
+		last = (j + 1 == config->frame_count) ? bit_count : (bit_count - config->trailer_bit_count);
+
 		/* Toggle the GPIO bit by bit */
 		old_bit = 'N';
-		for (i = 0; i < bit_count; i++) {
+		for (i = first; i < last; i++) {
 			new_bit = (frame_data[i/8] & (1 << (7 - (i % 8)))) ? '1' : '0';
 
 			switch (config->bit_fmt) {
@@ -230,17 +318,21 @@ static int sysfs_gpio_send_cmd(struct timing_config *config, uint8_t *frame_data
 	/* Make sure to turn off the transmitter */
 	write(fd, "0", 1);
 
-	close(fd);
-
 	return 0;
 }
 
+static struct rf_hardware_caps sysfs_gpio_caps = {
+	.time_step = GPIO_SYSFS_TIME_STEP,
+	.segmented_frames = 1,
+};
+
 struct rf_hardware_driver sysfs_gpio_driver = {
 	.name = HARDWARE_NAME,
 	.cmd_name = "sysfs-gpio",
 	.long_name = "SYSFS GPIO-based 433 MHz RF Transmitter",
 	.supported_bit_fmts = (1 << RF_BIT_FMT_HL) | (1 << RF_BIT_FMT_LH) | (1 << RF_BIT_FMT_RAW),
 	.needed_hw_params = PARAM_GPIO,
+	.caps = &sysfs_gpio_caps,
 	.probe = &sysfs_gpio_probe,
 	.init = &sysfs_gpio_init,
 	.close = &sysfs_gpio_close,
@@ -0,0 +1,219 @@
+/*
+ * rf-ctrl - A command-line tool to control 433MHz OOK based devices
+ * WAV/raw PCM file renderer, producing what the Alsa driver would play
+ *
+ * Copyright (C) 2018 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "rf-ctrl.h"
+#include "audio.h"
+
+#define HARDWARE_NAME			"WAV"
+
+#define WAV_STDOUT			"-"
+#define WAV_RAW_SUFFIX			".raw"
+#define WAV_PCM_SUFFIX			".pcm"
+
+#define WAV_DEFAULT_RATE		48000
+#define WAV_DEFAULT_CHANNELS		2
+#define WAV_CHANNELS_MAX		8
+#define WAV_DATA_CHANNEL		1
+#define WAV_SAMPLE_SIZE			2 // 16bits, little endian
+#define WAV_SAMPLE_HIGH			0x8000
+#define WAV_SAMPLE_LOW			0x7FFF
+#define WAV_CHUNK_FRAMES		1024
+
+#define WAV_HEADER_SIZE			44
+#define WAV_SIZE_UNKNOWN		0xFFFFFFFF
+
+static FILE *output = NULL;
+static int raw_output = 0;
+static unsigned int samplerate = WAV_DEFAULT_RATE;
+static unsigned int channels = WAV_DEFAULT_CHANNELS;
+static size_t frame_bytes;
+static uint64_t data_size = 0;
+static uint8_t frame_high[WAV_CHANNELS_MAX * WAV_SAMPLE_SIZE];
+static uint8_t frame_low[WAV_CHANNELS_MAX * WAV_SAMPLE_SIZE];
+static uint8_t chunk[WAV_CHUNK_FRAMES * WAV_CHANNELS_MAX * WAV_SAMPLE_SIZE];
+
+/* Refined once the sample rate is known */
+static struct rf_hardware_caps wav_caps = {
+	.time_step = (1000000 + WAV_DEFAULT_RATE/2)/WAV_DEFAULT_RATE,
+	.segmented_frames = 1,
+};
+
+
+static void wav_put_le(uint8_t *buf, uint32_t value, int len) {
+	int i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = (value >> (8 * i)) & 0xFF;
+	}
+}
+
+static int wav_write_header(uint32_t size) {
+	uint8_t header[WAV_HEADER_SIZE];
+
+	memcpy(header, "RIFF", 4);
+	wav_put_le(header + 4, (size == WAV_SIZE_UNKNOWN) ? size : (size + WAV_HEADER_SIZE - 8), 4);
+	memcpy(header + 8, "WAVE", 4);
+
+	memcpy(header + 12, "fmt ", 4);
+	wav_put_le(header + 16, 16, 4);
+	wav_put_le(header + 20, 1, 2); // PCM
+	wav_put_le(header + 22, channels, 2);
+	wav_put_le(header + 24, samplerate, 4);
+	wav_put_le(header + 28, samplerate * frame_bytes, 4);
+	wav_put_le(header + 32, frame_bytes, 2);
+	wav_put_le(header + 34, WAV_SAMPLE_SIZE * 8, 2);
+
+	memcpy(header + 36, "data", 4);
+	wav_put_le(header + 40, size, 4);
+
+	if (fwrite(header, sizeof(header), 1, output) != 1) {
+		fprintf(stderr, "%s: cannot write the WAV header (%s)\n", HARDWARE_NAME, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int has_suffix(char *str, char *suffix) {
+	size_t len = strlen(str), suffix_len = strlen(suffix);
+
+	return (len >= suffix_len) && !strcmp(str + len - suffix_len, suffix);
+}
+
+static int wav_probe(void) {
+	/* This driver cannot be auto-detected */
+	return -1;
+}
+
+static void wav_close(void) {
+	if (output == NULL) {
+		return;
+	}
+
+	/* Fill in the sizes, if the output can be rewound */
+	if (!raw_output && data_size <= (WAV_SIZE_UNKNOWN - WAV_HEADER_SIZE) && fseek(output, 0, SEEK_SET) == 0) {
+		wav_write_header(data_size);
+	}
+
+	fclose(output);
+	output = NULL;
+}
+
+static int wav_init(struct rf_hardware_params *params) {
+	unsigned int i;
+	int fd;
+
+	samplerate = params->alsa_rate ? params->alsa_rate : WAV_DEFAULT_RATE;
+	channels = params->alsa_channels ? params->alsa_channels : WAV_DEFAULT_CHANNELS;
+	if (channels > WAV_CHANNELS_MAX) {
+		fprintf(stderr, "%s: too many channels (%u)\n", HARDWARE_NAME, channels);
+		return -1;
+	}
+
+	if (!strcmp(params->device, WAV_STDOUT)) {
+		/* Keep the real stdout for the samples, and send the messages to stderr instead */
+		if ((fd = dup(STDOUT_FILENO)) < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0 || (output = fdopen(fd, "w")) == NULL) {
+			fprintf(stderr, "%s: cannot use the standard output (%s)\n", HARDWARE_NAME, strerror(errno));
+			return -1;
+		}
+		raw_output = 0;
+	} else {
+		if ((output = fopen(params->device, "w")) == NULL) {
+			fprintf(stderr, "%s: cannot open %s (%s)\n", HARDWARE_NAME, params->device, strerror(errno));
+			return -1;
+		}
+		raw_output = has_suffix(params->device, WAV_RAW_SUFFIX) || has_suffix(params->device, WAV_PCM_SUFFIX);
+	}
+
+	wav_caps.time_step = (1000000 + samplerate/2)/samplerate;
+
+	/* Same samples as the Alsa driver in its default S16_LE format, the signal being on the second channel */
+	frame_bytes = channels * WAV_SAMPLE_SIZE;
+	memset(frame_high, 0, sizeof(frame_high));
+	memset(frame_low, 0, sizeof(frame_low));
+	i = (channels > WAV_DATA_CHANNEL) ? WAV_DATA_CHANNEL : (channels - 1);
+	wav_put_le(frame_high + i * WAV_SAMPLE_SIZE, WAV_SAMPLE_HIGH, WAV_SAMPLE_SIZE);
+	wav_put_le(frame_low + i * WAV_SAMPLE_SIZE, WAV_SAMPLE_LOW, WAV_SAMPLE_SIZE);
+
+	dbg_printf(2, "%s: Writing %s to %s (S16_LE, %u Hz, %u channels)\n", HARDWARE_NAME, raw_output ? "raw PCM" : "WAV",
+		params->device, samplerate, channels);
+
+	data_size = 0;
+	if (!raw_output && wav_write_header(WAV_SIZE_UNKNOWN) < 0) {
+		wav_close();
+		return -1;
+	}
+
+	return 0;
+}
+
+static int wav_send_cmd(struct timing_config *config, uint8_t *frame_data, uint16_t bit_count) {
+	struct audio_render_state state;
+	size_t count, run, i;
+	uint8_t level;
+	uint8_t *dest;
+
+	audio_render_init(&state, config, frame_data, bit_count, samplerate);
+
+	dbg_printf(2, "%s: Number of samples to write: %lu\n", HARDWARE_NAME, (long unsigned int) (state.total * channels));
+
+	do {
+		/* Render the frame chunk by chunk */
+		dest = chunk;
+		count = 0;
+		while (count < WAV_CHUNK_FRAMES && (run = audio_render_run(&state, WAV_CHUNK_FRAMES - count, &level)) > 0) {
+			for (i = 0; i < run; i++) {
+				memcpy(dest, level ? frame_high : frame_low, frame_bytes);
+				dest += frame_bytes;
+			}
+			count += run;
+		}
+
+		if (count > 0 && fwrite(chunk, frame_bytes, count, output) != count) {
+			fprintf(stderr, "%s: Write error (%s)\n", HARDWARE_NAME, strerror(errno));
+			return -1;
+		}
+
+		data_size += count * frame_bytes;
+	} while (count == WAV_CHUNK_FRAMES);
+
+	return 0;
+}
+
+struct rf_hardware_driver wav_driver = {
+	.name = HARDWARE_NAME,
+	.cmd_name = "wav",
+	.long_name = "WAV/PCM File Renderer",
+	.supported_bit_fmts = (1 << RF_BIT_FMT_HL) | (1 << RF_BIT_FMT_LH) | (1 << RF_BIT_FMT_RAW),
+	.needed_hw_params = PARAM_HW_DEVICE,
+	.caps = &wav_caps,
+	.probe = &wav_probe,
+	.init = &wav_init,
+	.close = &wav_close,
+	.send_cmd = &wav_send_cmd,
+};